@@ -0,0 +1,22 @@
+#!/bin/sh
+#
+# Compares two sish_bench result files, printing the change of every
+# metric present in both.
+#
+# usage: compare.sh before.txt after.txt
+
+if [ $# -ne 2 ]; then
+    echo "usage: compare.sh before.txt after.txt" >&2
+    exit 1
+fi
+
+awk -F '\t' '
+    NR == FNR {
+        before[$1] = $2
+        next
+    }
+    ($1 in before) {
+        change = before[$1] == 0 ? 0 : ($2 - before[$1]) / before[$1] * 100
+        printf "%-22s %14.3f %14.3f %+8.1f%%  %s\n", $1, before[$1], $2, change, $3
+    }
+' "$1" "$2"
@@ -0,0 +1,365 @@
+/* mkdtemp, snprintf and clock_gettime are hidden by -ansi otherwise */
+#define _POSIX_C_SOURCE 200809L
+
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+
+#include "sish_bench.h"
+
+/**
+ * sish_bench measures the cost of the shell itself on a handful of
+ * workloads and prints one tab separated "metric value unit" line per
+ * result, so the output of two builds can be compared with compare.sh.
+ **/
+int
+main(int argc, char **argv) {
+    int case_identifier, scale;
+    char *shell, directory[] = "/tmp/sish_bench.XXXXXX";
+
+    scale = 1;
+
+    while ((case_identifier = getopt(argc, argv, "n:")) != -1) {
+        switch (case_identifier) {
+        case 'n':
+            if ((scale = atoi(optarg)) < 1) {
+                print_bench_usage();
+                return 1;
+            }
+            break;
+        default:
+            print_bench_usage();
+            return 1;
+        }
+    }
+
+    if (optind != argc - 1) {
+        print_bench_usage();
+        return 1;
+    }
+
+    shell = argv[optind];
+
+    if (mkdtemp(directory) == NULL) {
+        fprintf(stderr, "sish_bench: Could not create directory: %s\n", strerror(errno));
+        return 1;
+    }
+
+    if (bench_exec_latency(shell, 200 * scale) != 0 ||
+        bench_interactive_lines(shell, 5000 * scale) != 0 ||
+        bench_long_line(shell, 10000, 20 * scale) != 0 ||
+        bench_pipeline_throughput(shell, directory, 64 * scale, 4) != 0 ||
+        bench_background_fanout(shell, 64, 20 * scale) != 0) {
+        (void) rmdir(directory);
+        return 1;
+    }
+
+    (void) rmdir(directory);
+
+    return 0;
+}
+
+void
+print_bench_usage() {
+    fprintf(stderr, "usage: sish_bench [-n scale] path-to-sish\n");
+}
+
+double
+now_seconds() {
+    struct timespec now;
+
+    (void) clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+void
+report(char *metric, double value, char *unit) {
+    fprintf(stdout, "%s\t%.3f\t%s\n", metric, value, unit);
+    (void) fflush(stdout);
+}
+
+/**
+ * run_shell runs the shell with the given -c command, or in interactive
+ * mode when command is NULL, feeding it input on stdin. Its stdout goes
+ * to /dev/null unless output_fd is given. Returns the shell's exit
+ * status, or -1 if it could not be run.
+ **/
+int
+run_shell(char *shell, char *command, char *input, size_t input_length, int output_fd) {
+    int input_pipe[2], null_fd, status;
+    pid_t child;
+    ssize_t written;
+    size_t done;
+
+    if (pipe(input_pipe) < 0) {
+        fprintf(stderr, "sish_bench: Could not create a pipe: %s\n", strerror(errno));
+        return -1;
+    }
+
+    if ((child = fork()) < 0) {
+        fprintf(stderr, "sish_bench: Could not fork: %s\n", strerror(errno));
+        return -1;
+    } else if (child == 0) {
+        if ((null_fd = open("/dev/null", O_WRONLY)) < 0) {
+            exit(127);
+        }
+
+        (void) dup2(input_pipe[0], STDIN_FILENO);
+        (void) dup2(output_fd >= 0 ? output_fd : null_fd, STDOUT_FILENO);
+        (void) close(input_pipe[0]);
+        (void) close(input_pipe[1]);
+        (void) close(null_fd);
+
+        if (command != NULL) {
+            (void) execl(shell, shell, "-c", command, (char *) NULL);
+        } else {
+            (void) execl(shell, shell, (char *) NULL);
+        }
+
+        fprintf(stderr, "sish_bench: %s: %s\n", shell, strerror(errno));
+        exit(127);
+    }
+
+    (void) close(input_pipe[0]);
+
+    for (done = 0; done < input_length; done += written) {
+        if ((written = write(input_pipe[1], input + done, input_length - done)) < 0) {
+            break;
+        }
+    }
+
+    (void) close(input_pipe[1]);
+
+    if (waitpid(child, &status, 0) < 0 || !WIFEXITED(status)) {
+        return -1;
+    }
+
+    return WEXITSTATUS(status);
+}
+
+/**
+ * Fork, exec and exit of "sish -c true", which with in-place exec of the
+ * final command is a single process.
+ **/
+int
+bench_exec_latency(char *shell, int iterations) {
+    double start;
+    int index;
+
+    start = now_seconds();
+
+    for (index = 0; index < iterations; index++) {
+        if (run_shell(shell, "true", NULL, 0, -1) != 0) {
+            fprintf(stderr, "sish_bench: sish -c true failed\n");
+            return 1;
+        }
+    }
+
+    report("exec_latency", (now_seconds() - start) / iterations * 1e6, "us/op");
+
+    return 0;
+}
+
+/**
+ * Cost of one trip around the interactive loop: prompt, getline and a
+ * builtin that does not fork.
+ **/
+int
+bench_interactive_lines(char *shell, int lines) {
+    char *input, line[] = "echo x\n";
+    size_t length;
+    double start;
+    int index;
+
+    length = lines * strlen(line) + strlen("exit\n");
+
+    if ((input = malloc(length + 1)) == NULL) {
+        fprintf(stderr, "sish_bench: Could not allocate memory\n");
+        return 1;
+    }
+
+    input[0] = '\0';
+    for (index = 0; index < lines; index++) {
+        (void) memcpy(input + index * strlen(line), line, strlen(line) + 1);
+    }
+    (void) strcat(input, "exit\n");
+
+    start = now_seconds();
+
+    if (run_shell(shell, NULL, input, length, -1) != 0) {
+        fprintf(stderr, "sish_bench: interactive loop failed\n");
+        return 1;
+    }
+
+    report("interactive_line", (now_seconds() - start) / lines * 1e6, "us/line");
+
+    (void) free(input);
+
+    return 0;
+}
+
+/**
+ * Tokenizing and expanding very long lines in execute_command. The line
+ * is handed to cd, which ignores the extra words, so only the parse is
+ * measured and nothing is forked per line.
+ **/
+int
+bench_long_line(char *shell, int words, int lines) {
+    char *input, word[] = " word$$";
+    size_t line_length, length;
+    double start, elapsed;
+    int index, line;
+
+    line_length = strlen("cd .") + words * strlen(word) + 1;
+    length = lines * line_length + strlen("exit\n");
+
+    if ((input = malloc(length + 1)) == NULL) {
+        fprintf(stderr, "sish_bench: Could not allocate memory\n");
+        return 1;
+    }
+
+    length = 0;
+    for (line = 0; line < lines; line++) {
+        (void) memcpy(input + length, "cd .", 4);
+        length += 4;
+        for (index = 0; index < words; index++) {
+            (void) memcpy(input + length, word, strlen(word));
+            length += strlen(word);
+        }
+        input[length++] = '\n';
+    }
+    (void) memcpy(input + length, "exit\n", 6);
+    length += 5;
+
+    start = now_seconds();
+
+    if (run_shell(shell, NULL, input, length, -1) != 0) {
+        fprintf(stderr, "sish_bench: long line parse failed\n");
+        return 1;
+    }
+
+    elapsed = now_seconds() - start;
+
+    report("long_line_parse", elapsed / lines * 1e3, "ms/line");
+    report("long_line_token", elapsed / ((double) lines * words) * 1e9, "ns/token");
+
+    (void) free(input);
+
+    return 0;
+}
+
+/**
+ * Bytes per second through a pipeline of stages connected by
+ * pipleline_input_commands.
+ **/
+int
+bench_pipeline_throughput(char *shell, char *directory, int megabytes, int stages) {
+    char path[PATH_LENGTH], *command, block[65536];
+    double start;
+    int fd, index;
+
+    (void) snprintf(path, sizeof(path), "%s/input", directory);
+
+    if ((fd = open(path, O_CREAT | O_WRONLY | O_TRUNC, 0600)) < 0) {
+        fprintf(stderr, "sish_bench: %s: %s\n", path, strerror(errno));
+        return 1;
+    }
+
+    for (index = 0; index < (int) sizeof(block); index++) {
+        block[index] = (index % 64 == 63) ? '\n' : 'a' + index % 26;
+    }
+
+    for (index = 0; index < megabytes * 16; index++) {
+        if (write(fd, block, sizeof(block)) != sizeof(block)) {
+            fprintf(stderr, "sish_bench: %s: %s\n", path, strerror(errno));
+            return 1;
+        }
+    }
+
+    (void) close(fd);
+
+    if ((command = malloc(strlen(path) + stages * 8 + 32)) == NULL) {
+        fprintf(stderr, "sish_bench: Could not allocate memory\n");
+        return 1;
+    }
+
+    (void) sprintf(command, "cat %s", path);
+    for (index = 1; index < stages; index++) {
+        (void) strcat(command, " | cat");
+    }
+
+    start = now_seconds();
+
+    if (run_shell(shell, command, NULL, 0, -1) != 0) {
+        fprintf(stderr, "sish_bench: pipeline failed\n");
+        return 1;
+    }
+
+    report("pipeline_throughput", megabytes / (now_seconds() - start), "MB/s");
+
+    (void) unlink(path);
+    (void) free(command);
+
+    return 0;
+}
+
+/**
+ * Time to start jobs background jobs with & and for all of them to
+ * finish. Every job inherits the pipe used as stdout, so end of file on
+ * it means the last job has exited.
+ **/
+int
+bench_background_fanout(char *shell, int jobs, int iterations) {
+    char *command, buffer[512];
+    int output_pipe[2], index, iteration;
+    double start, elapsed;
+
+    if ((command = malloc(jobs * strlen("true & ") + 1)) == NULL) {
+        fprintf(stderr, "sish_bench: Could not allocate memory\n");
+        return 1;
+    }
+
+    command[0] = '\0';
+    for (index = 0; index < jobs; index++) {
+        (void) strcat(command, "true & ");
+    }
+
+    start = now_seconds();
+
+    for (iteration = 0; iteration < iterations; iteration++) {
+        if (pipe(output_pipe) < 0) {
+            fprintf(stderr, "sish_bench: Could not create a pipe: %s\n", strerror(errno));
+            return 1;
+        }
+
+        if (run_shell(shell, command, NULL, 0, output_pipe[1]) != 0) {
+            fprintf(stderr, "sish_bench: background fanout failed\n");
+            return 1;
+        }
+
+        (void) close(output_pipe[1]);
+
+        while (read(output_pipe[0], buffer, sizeof(buffer)) > 0) {
+            continue;
+        }
+
+        (void) close(output_pipe[0]);
+    }
+
+    elapsed = now_seconds() - start;
+
+    report("background_fanout", elapsed / iterations * 1e3, "ms/run");
+    report("background_job", elapsed / ((double) iterations * jobs) * 1e6, "us/job");
+
+    (void) free(command);
+
+    return 0;
+}
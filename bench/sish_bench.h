@@ -0,0 +1,13 @@
+#define PATH_LENGTH 1024
+
+void print_bench_usage();
+void report(char *metric, double value, char *unit);
+
+int run_shell(char *shell, char *command, char *input, size_t input_length, int output_fd);
+int bench_exec_latency(char *shell, int iterations);
+int bench_interactive_lines(char *shell, int lines);
+int bench_long_line(char *shell, int words, int lines);
+int bench_pipeline_throughput(char *shell, char *directory, int megabytes, int stages);
+int bench_background_fanout(char *shell, int jobs, int iterations);
+
+double now_seconds();
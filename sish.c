@@ -1,3 +1,10 @@
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/uio.h>
+#include <sys/un.h>
 #include <sys/wait.h>
 
 #include <stdio.h>
@@ -10,6 +17,16 @@
 #include <pwd.h>
 #include <setjmp.h>
 #include <fcntl.h>
+#include <getopt.h>
+#include <poll.h>
+#include <sched.h>
+#include <time.h>
+#include <termios.h>
+#include <ctype.h>
+
+#if defined(__linux__)
+#include <sys/syscall.h>
+#endif
 
 #include "sish.h"
 
@@ -23,12 +40,26 @@ handle_sig_int(__attribute__((unused)) int signal) {
     return;
 }
 
+void
+handle_sig_child(__attribute__((unused)) int signal) {
+    /* Only used to interrupt pselect in server mode */
+    return;
+}
+
 int
 main (int argc, char **argv) {
     extern char *optarg;
-    int case_identifier, exit, status;
+    int case_identifier, exit, status, history_status, interactive;
+    pid_t child;
     size_t input_size_max;
-    char *input_command;
+    char *input_command, *expanded_command;
+    struct option long_options[] = {
+        { "server", required_argument, NULL, 'S' },
+        { "client", required_argument, NULL, 'C' },
+        { "record", required_argument, NULL, 'R' },
+        { "replay", required_argument, NULL, 'P' },
+        { NULL,     0,                 NULL, 0   }
+    };
 
     (void) setprogname(argv[0]);
     exit = 0;
@@ -36,15 +67,32 @@ main (int argc, char **argv) {
 
     input_flags.c_flag = 0;
     input_flags.x_flag = 0;
+    input_flags.pipefail = 0;
+    input_flags.pipe_stats = 0;
+    input_flags.arg_batch = 0;
+    input_flags.server_path = NULL;
+    input_flags.client_path = NULL;
+    input_flags.record_path = NULL;
+    input_flags.replay_path = NULL;
+
+    shell_history.fd = -1;
+
+    if (getenv("SISH_STATS") != NULL) {
+        statistics_pid = getpid();
+        if (atexit(dump_shell_statistics) != 0) {
+            print_error("Could not register exit handler", 1);
+            return 1;
+        }
+    }
 
     /* Need backup of stdout/in as we need to restore in case
        of redirection */
-    if ((default_standard_input = dup(STDIN_FILENO)) < 0) {
+    if ((default_standard_input = duplicate_shell_descriptor(STDIN_FILENO)) < 0) {
         print_error("Could not duplicate file descriptor", 1);
         return 1;
     }
     
-    if ((default_standard_output = dup(STDOUT_FILENO)) < 0) {
+    if ((default_standard_output = duplicate_shell_descriptor(STDOUT_FILENO)) < 0) {
         print_error("Could not duplicate file descriptor", 1);
         return 1;
     }
@@ -54,7 +102,7 @@ main (int argc, char **argv) {
         return 1;
     }
 
-    while ((case_identifier = getopt(argc, argv, "xc:")) != -1) {
+    while ((case_identifier = getopt_long(argc, argv, "xc:", long_options, NULL)) != -1) {
         switch (case_identifier) {
         case 'c':
             input_flags.c_flag = 1;
@@ -66,6 +114,18 @@ main (int argc, char **argv) {
         case 'x':
             input_flags.x_flag = 1;
             break;
+        case 'S':
+            input_flags.server_path = optarg;
+            break;
+        case 'C':
+            input_flags.client_path = optarg;
+            break;
+        case 'R':
+            input_flags.record_path = optarg;
+            break;
+        case 'P':
+            input_flags.replay_path = optarg;
+            break;
         case '?':
             print_usage();
             return 1;
@@ -74,23 +134,46 @@ main (int argc, char **argv) {
         }
     }
 
-    if (input_flags.c_flag) {
-        if (strchr(input_command, '&')) {
-            (void) execute_backgroud_process(input_command);
-        } else {
-            if (strchr(input_command, '|')) {
-                (void) pipleline_input_commands(input_command);
-            } else {
-                (void) execute_command(input_command);
-            }
+    if (input_flags.server_path != NULL) {
+        return run_server(input_flags.server_path);
+    }
+
+    if (input_flags.client_path != NULL) {
+        if (!input_flags.c_flag) {
+            print_usage();
+            return 1;
         }
+        return run_client(input_flags.client_path, input_command);
+    }
+
+    if (input_flags.record_path != NULL && open_record(input_flags.record_path) != 0) {
+        return 1;
+    }
+
+    if (input_flags.replay_path != NULL) {
+        return replay_session(input_flags.replay_path);
+    }
+
+    if (input_flags.c_flag) {
+        /* Nothing is left to do after the -c command, so a simple command
+           can replace the shell instead of being forked and waited for,
+           unless it is recorded and the shell has to see it finish */
+        execute_in_place = record_file == NULL;
+        (void) execute_timed_line(input_command, NULL);
+        execute_in_place = 0;
     } else {
         if (signal(SIGINT, handle_sig_int) == SIG_ERR) {
             print_error("Could not register signal", 1);
 		    return 1;
 	    }
+        /* Scripts and benchmarks fed on stdin stay out of the history,
+           and a ! in them is left alone */
+        if ((interactive = isatty(STDIN_FILENO))) {
+            (void) open_history();
+        }
         while (exit == 0) {
-            if (waitpid(-1, &status, WNOHANG) > 0) {
+            if ((child = waitpid(-1, &status, WNOHANG)) > 0) {
+                (void) reap_coprocess(child);
                 fprintf(stdout, "Done\n");
                 if (WIFEXITED(status)) {
                     previous_exit_code = WEXITSTATUS(status);
@@ -98,14 +181,25 @@ main (int argc, char **argv) {
             }
             errno = 0;
             (void) setjmp(JumpBuffer);
-            fprintf(stdout, "%s$ ", getprogname());
-            if (getline(&input_command, &input_size_max, stdin) == -1) {
+            /* An interrupted brace group never unregisters its copies */
+            saved_descriptors = NULL;
+            if (read_input_line(&input_command, &input_size_max) == -1) {
                 print_error("Could not get input", 1);
                 return 1;
             }
 
-            /* getline also includes the '\n' at the end, hence we replace it by null*/
-            (void) strip_new_line(input_command);
+            if (interactive) {
+                if ((history_status = expand_history(input_command, &expanded_command)) < 0) {
+                    continue;
+                } else if (history_status > 0) {
+                    (void) free(input_command);
+                    input_command = expanded_command;
+                    input_size_max = strlen(input_command) + 1;
+                    fprintf(stdout, "%s\n", input_command);
+                }
+
+                (void) add_history(input_command);
+            }
 
             if (strcmp(input_command, "exit") == 0) {
                 if (input_flags.x_flag) {
@@ -114,681 +208,5825 @@ main (int argc, char **argv) {
                 break;
             }
 
-            if (strchr(input_command, '&')) {
-                (void) execute_backgroud_process(input_command);
-            } else {
-                if (strchr(input_command, '|')) {
-                    (void) pipleline_input_commands(input_command);
-                } else {
-                    (void) execute_command(input_command);
-                }
-            }
+            (void) execute_timed_line(input_command, NULL);
         }
     }
 
     (void) free(input_command);
 
+    if (input_flags.c_flag) {
+        return previous_exit_code;
+    }
+
     return 0;
 }
 
 /**
- * This method is called when the input command contains &.
- * Hence this tells us that we have commands which need to be
- * executed in background
+ * execute_input_line executes a complete line of input. The line is
+ * a list of pipelines separated by ;, &&, || and &.
  **/
 void
-execute_backgroud_process(char *input_command) {
-    char *last, *input_command_copy, *command;
-    pid_t child;
-    int background_last_command, commands, commands_index;
+execute_input_line(char *input_command) {
+    (void) execute_list(input_command);
+}
 
-    background_last_command = 0;
-    commands = 0;
-    commands_index = 0;
+/**
+ * execute_list walks the list items of the input. Items ending in &
+ * are started in the background, && and || skip the following item
+ * based on the exit code of the previous one, and only the final
+ * foreground item may replace the process when execute_in_place is set.
+ **/
+void
+execute_list(char *list) {
+    struct list_item *items;
+    int count;
 
-    if ((input_command_copy = strdup(input_command)) == NULL) {
+    if (split_list(list, &items, &count) != 0) {
         print_error("Could not allocate memory", 1);
         previous_exit_code = 127;
         return;
     }
 
-    if ((commands = get_char_count(input_command, "&")) < 0) {
-        print_error("Could not allocate memory", 1);
-        previous_exit_code = 127;
-        return;
-    }
+    (void) execute_list_items(items, count);
+    (void) free_list_items(items, count);
+}
 
-    if (input_command[strlen(input_command) - 1] == '&') {
-        background_last_command = 1;
-    }
+/**
+ * execute_list_items runs a list split up by split_list. Kept apart
+ * from the splitting so that sourced scripts can be split only once.
+ **/
+void
+execute_list_items(struct list_item *items, int count) {
+    int index, last, in_place, skip;
 
-    command = strtok_r(input_command_copy, "&", &last);
+    skip = 0;
+    in_place = execute_in_place;
 
-    while (command != NULL) {
-        if ((commands - commands_index) == 1 && !background_last_command) {
-            if (strchr(input_command, '|')) {
-                (void) pipleline_input_commands(command);
-            } else {
-                (void) execute_command(command);
-            }
-        } else {
-            if ((child = fork()) < 0) {
-                print_error("Could not allocate memory", 1);
-                previous_exit_code = 127;
-                return;
-            } else if (child == 0) {
-                if (strchr(input_command, '|')) {
-                    (void) pipleline_input_commands(command);
-                } else {
-                    (void) execute_command(command);
-                }
+    for (last = count - 1; last >= 0 && is_blank_string(items[last].text); last--) {
+        continue;
+    }
 
-                exit(previous_exit_code);
+    for (index = 0; index < count; index++) {
+        if (!skip && !is_blank_string(items[index].text)) {
+            if (items[index].separator == LIST_BACKGROUND) {
+                execute_in_place = 0;
+                (void) execute_backgroud_process(items[index].text);
+            } else {
+                execute_in_place = in_place && index == last;
+                (void) execute_pipeline(items[index].text);
             }
         }
 
-        command = strtok_r(NULL, "&", &last);
-        commands_index++;
+        if (items[index].separator == LIST_AND) {
+            skip = previous_exit_code != 0;
+        } else if (items[index].separator == LIST_OR) {
+            skip = previous_exit_code == 0;
+        } else {
+            skip = 0;
+        }
     }
+
+    execute_in_place = in_place;
 }
 
 /**
- * pipleline_input_commands is executed when the input
- * contains pipes. We tokenize based on the pipes and then
- * connect the stdout to stdin of the following commands
- * After that the execute_command method is called
+ * split_list splits a list into its items and the separators ending
+ * them.
  **/
-void
-pipleline_input_commands(char *input_command) {
-    int index, stdout_pipe[2], stdin_fd, stdout_fd;
-    int command_count;
-    pid_t child;
-    int status;
-    char *last, *command, *input_command_copy;
+int
+split_list(char *list, struct list_item **items, int *count) {
+    struct list_item *grown;
+    char *item;
+    int position, separator, capacity;
+
+    *items = NULL;
+    *count = 0;
+    capacity = 0;
+    position = 0;
+
+    while (next_list_item(list, &position, &item, &separator) == 0) {
+        if (item == NULL) {
+            (void) free_list_items(*items, *count);
+            return 1;
+        }
 
-    index = 0;
+        if (*count == capacity) {
+            capacity = capacity ? capacity * 2 : 4;
+            if ((grown = realloc(*items, capacity * sizeof(struct list_item))) == NULL) {
+                (void) free(item);
+                (void) free_list_items(*items, *count);
+                return 1;
+            }
+            *items = grown;
+        }
 
-    if ((command_count = get_char_count(input_command, "|")) < 0) {
-        print_error("Could not allocate memory", 1);
-        previous_exit_code = 127;
-        return;
+        (*items)[*count].text = item;
+        (*items)[*count].separator = separator;
+        (*count)++;
     }
 
-    if ((input_command_copy = strdup(input_command)) == NULL) {
-        print_error("Could not allocate memory", 1);
-        previous_exit_code = 127;
-        return;
+    return 0;
+}
+
+void
+free_list_items(struct list_item *items, int count) {
+    int index;
+
+    for (index = 0; index < count; index++) {
+        (void) free(items[index].text);
     }
+    (void) free(items);
+}
 
-    if ((stdin_fd = dup(STDIN_FILENO)) < 1) {
-        print_error("Could not duplicate file descriptor", 1);
-        previous_exit_code = 127;
-        return;
+/**
+ * next_list_item copies the list item starting at position into item
+ * and reports the separator that ended it. Separators nested inside
+ * ( ) or { } belong to the group and are not split on. Returns 1 once
+ * the end of the list has been reached.
+ **/
+int
+next_list_item(char *list, int *position, char **item, int *separator) {
+    int index, start, depth, separator_length;
+
+    start = *position;
+
+    if (list[start] == '\0') {
+        return 1;
     }
 
-    command = strtok_r(input_command_copy, "|", &last);
+    depth = 0;
+    separator_length = 0;
+    *separator = LIST_END;
 
-    while (command != NULL) {
-        if (pipe(stdout_pipe)) {
-            print_error("Could not create a pipe", 1);
-            previous_exit_code = 127;
-            return;
+    for (index = start; list[index] != '\0'; index++) {
+        if ((depth = update_group_depth(list, index, depth)) > 0) {
+            continue;
         }
 
-        if ((command_count - index) == 1) {
-            if ((stdout_fd = dup(STDOUT_FILENO)) < 0) {
-                print_error("Could not duplicate file descriptor", 1);
-                previous_exit_code = 127;
-                return;
+        /* The & of >&N and <&N names a descriptor */
+        if (list[index] == '&' && index > start &&
+            (list[index - 1] == '>' || list[index - 1] == '<')) {
+            continue;
+        }
+
+        if (list[index] == ';' || list[index] == '\n') {
+            *separator = LIST_SEQUENTIAL;
+            separator_length = 1;
+        } else if (list[index] == '&') {
+            if (list[index + 1] == '&') {
+                *separator = LIST_AND;
+                separator_length = 2;
+            } else {
+                *separator = LIST_BACKGROUND;
+                separator_length = 1;
             }
-            (void) close(stdout_pipe[1]);
+        } else if (list[index] == '|' && list[index + 1] == '|') {
+            *separator = LIST_OR;
+            separator_length = 2;
         } else {
-            stdout_fd = stdout_pipe[1];
+            continue;
         }
 
-        if ((child = fork()) < 0) {
-            print_error("Could not fork a child", 1);
-            previous_exit_code = 127;
-            return;
-        } else if (child == 0) {
-            if (dup2(stdin_fd, STDIN_FILENO) != STDIN_FILENO) {
-                fprintf(stderr, "Could not duplicate fd: %s \n", strerror(errno));
-                exit(127);
-            }
+        break;
+    }
 
-            if (dup2(stdout_fd, STDOUT_FILENO) != STDOUT_FILENO) {
-                fprintf(stderr, "Could not duplicate fd: %s \n", strerror(errno));
-                exit(127);
-            }
+    if ((*item = malloc(index - start + 1)) != NULL) {
+        (void) memcpy(*item, list + start, index - start);
+        (*item)[index - start] = '\0';
+    }
 
-            (void) execute_command(command);
-            exit(127);
-        } else {
-            (void) close(stdout_fd);
-            (void) close(stdin_fd);
-            (void) waitpid(child, &status, 0);
+    *position = index + separator_length;
 
-            if (WIFEXITED(status)) {
-                previous_exit_code = WEXITSTATUS(status);
-            }
+    return 0;
+}
 
-            /*Assign the read end of the pipe to stdin of the following command*/
-            stdin_fd = stdout_pipe[0];
+/**
+ * update_group_depth returns the nesting depth after the character at
+ * index. ( and ) always count, while { and } only count when they
+ * stand as words of their own, as in "{ cmd; }".
+ **/
+int
+update_group_depth(char *line, int index, int depth) {
+    char previous, next;
+
+    previous = index > 0 ? line[index - 1] : ' ';
+    next = line[index + 1];
+
+    if (line[index] == '(') {
+        return depth + 1;
+    }
+
+    if (line[index] == '{' && strchr(" \t\n;&|(", previous) != NULL &&
+        (next == '\0' || strchr(" \t\n", next) != NULL)) {
+        return depth + 1;
+    }
+
+    if (line[index] == ')' || (line[index] == '}' && strchr(" \t\n;", previous) != NULL &&
+        (next == '\0' || strchr(" \t\n;&|)<>", next) != NULL))) {
+        return depth > 0 ? depth - 1 : 0;
+    }
+
+    return depth;
+}
+
+/**
+ * find_top_level returns the index of the first occurrence of character
+ * in line that is not nested inside a group, or -1 if there is none.
+ **/
+int
+find_top_level(char *line, char character) {
+    int index, depth;
+
+    depth = 0;
+
+    for (index = 0; line[index] != '\0'; index++) {
+        if ((depth = update_group_depth(line, index, depth)) == 0 &&
+            line[index] == character) {
+            return index;
         }
-        
-        command = strtok_r(NULL, "|", &last);
-        index++;
     }
 
-    (void) close(stdin_fd);
-    (void) close(stdout_fd);
+    return -1;
+}
+
+/**
+ * find_group_end returns the index of the ) or } closing the group
+ * opened at start, or -1 if the group is never closed.
+ **/
+int
+find_group_end(char *line, int start) {
+    int index, depth;
+
+    depth = 0;
+
+    for (index = start; line[index] != '\0'; index++) {
+        if ((depth = update_group_depth(line, index, depth)) == 0) {
+            return index;
+        }
+    }
+
+    return -1;
+}
+
+int
+is_blank_string(char *string) {
+    while (*string == ' ' || *string == '\t' || *string == '\n') {
+        string++;
+    }
+
+    return *string == '\0';
 }
 
+/**
+ * execute_pipeline runs a single list item, which is either a pipeline
+ * or a lone simple or compound command.
+ **/
 void
-print_usage() {
-    fprintf(stderr, "%s: Usage: sish [-c command] [-x]\n", getprogname());
+execute_pipeline(char *command) {
+    if (find_top_level(command, '|') >= 0) {
+        (void) pipleline_input_commands(command);
+    } else {
+        (void) execute_compound_command(command);
+
+        if (set_status_variable("PIPESTATUS", &previous_exit_code, 1) != 0) {
+            print_error("Could not allocate memory", 1);
+        }
+    }
 }
 
 /**
- * strip_new_line will remove the '\n' at the end of the string. getline includes
- * '\n' which is not the user command but due to pressing enter to execute the command.
- * Hence we need to strip it before performing further processing on the input.
+ * This method is called for list items terminated by &. The item
+ * is executed in a child and the shell does not wait for it. The
+ * main loop reaps it later and reports Done.
  **/
 void
-strip_new_line(char *input) {
-    int input_length;
+execute_backgroud_process(char *command) {
+    pid_t child;
 
-    input_length = strlen(input);
-    if (input[input_length - 1] == '\n') {
-        input[input_length - 1] = '\0';
+    if ((child = fork_child()) < 0) {
+        print_error("Could not fork a child", 1);
+        previous_exit_code = 127;
+    } else if (child == 0) {
+        execute_in_place = 1;
+        (void) execute_pipeline(command);
+        exit(previous_exit_code);
     }
 }
 
 /**
- * This method is called after we have read the input from the terminal and 
- * split the input by the pipe
+ * execute_compound_command executes a ( list ) subshell, a { list; }
+ * brace group or, for anything else, a simple command. Redirections
+ * written after the closing ) or } apply to the whole group.
  **/
 void
-execute_command(char *command) {
-    char *last, *token, **tokens, *command_copy, *temp;
-    int token_count, token_count_estimate, index, status, command_length;
-    int redirection_status;
-    int token_index, token_length;
-    
-    index = 0;
-    token_count = 0;
+execute_compound_command(char *command) {
+    char *inner;
+    int start, end, group;
 
-    if (strlen(command) < 1 && command[0] == '\0') {
-        return;
+    for (start = 0; command[start] == ' ' || command[start] == '\t'; start++) {
+        continue;
     }
 
-    command_length = strlen(command);
+    if (command[start] != '(' && update_group_depth(command, start, 0) == 0) {
+        if ((group = find_prefixed_group(command + start)) > 0) {
+            (void) execute_prefixed_group(command + start, group);
+            return;
+        }
+        (void) execute_command(command);
+        return;
+    }
 
-    if ((token_count_estimate = get_char_count(command, " \t<>")) < 0) {
-        print_error("Could not allocate memory", 1);
+    if ((end = find_group_end(command, start)) < 0) {
+        errno = 0;
+        print_error(command[start] == '(' ? "Syntax error: missing )" :
+                                            "Syntax error: missing }", 1);
         previous_exit_code = 127;
         return;
     }
 
-    if ((tokens = malloc((token_count_estimate * sizeof(char *)) + 1)) == NULL) {
+    if ((inner = malloc(end - start)) == NULL) {
         print_error("Could not allocate memory", 1);
         previous_exit_code = 127;
         return;
     }
 
-    if ((command_copy = strdup(command)) == NULL) {
+    (void) memcpy(inner, command + start + 1, end - start - 1);
+    inner[end - start - 1] = '\0';
+
+    if (command[start] == '(') {
+        (void) execute_subshell(inner, command + end + 1);
+    } else {
+        (void) execute_brace_group(inner, command + end + 1);
+    }
+
+    (void) free(inner);
+}
+
+/**
+ * find_prefixed_group returns where the group starts in a command such
+ * as "timeout 5 ( a | b )", in which a prefix builtin wraps a group
+ * rather than a simple command, or -1.
+ **/
+int
+find_prefixed_group(char *command) {
+    int index, length;
+
+    length = strcspn(command, " \t");
+
+    if (!(length == 7 && strncmp(command, "timeout", 7) == 0) &&
+        !(length == 5 && strncmp(command, "sched", 5) == 0) &&
+        !(length == 6 && strncmp(command, "ulimit", 6) == 0)) {
+        return -1;
+    }
+
+    for (index = length; command[index] != '\0'; index++) {
+        if (update_group_depth(command, index, 0) > 0) {
+            return index;
+        }
+    }
+
+    return -1;
+}
+
+/**
+ * execute_prefixed_group runs the prefix builtin from the words before
+ * the group. The group itself is left unexpanded in prefixed_group for
+ * the builtin to run with run_prefixed_group, so it is parsed only once.
+ **/
+void
+execute_prefixed_group(char *command, int group) {
+    char *prefix;
+
+    if ((prefix = malloc(group + 1)) == NULL) {
         print_error("Could not allocate memory", 1);
         previous_exit_code = 127;
         return;
     }
 
-    token = strtok_r(command_copy, " \t", &last);
+    (void) memcpy(prefix, command, group);
+    prefix[group] = '\0';
 
-    while (token != NULL) {
-        if (strcmp(token, ">") == 0 || strcmp(token, ">>") == 0 || strcmp(token, "<") == 0 ) {
-            if ((tokens[index] = strdup(token)) == NULL) {
-                print_error("Could not allocate memory", 1);
-                previous_exit_code = 127;
-                return;
-            }
-            token = strtok_r(NULL, " \t", &last);
-            index++;
-            token_count++;
-            continue;
-        }
+    prefixed_group = command + group;
+    (void) execute_command(prefix);
+    prefixed_group = NULL;
 
-        if (!(strchr(token, '<') || strchr(token, '>'))) {
-            if ((tokens[index] = strdup(token)) == NULL) {
-                print_error("Could not allocate memory", 1);
-                previous_exit_code = 127;
-                return;
-            }
-            index++;
-            token_count++;
-            token = strtok_r(NULL, " \t", &last);
-            continue;
-        }
+    (void) free(prefix);
+}
 
-        token_length = strlen(token);
+/**
+ * run_prefixed_group runs the group a prefix builtin was given, in the
+ * process that is to run it.
+ **/
+void
+run_prefixed_group() {
+    char *group;
 
-        if ((temp = malloc(token_length)) == NULL) {
-            print_error("Could not allocate memory", 1);
-            previous_exit_code = 127;
-            return;
-        }
+    group = prefixed_group;
+    prefixed_group = NULL;
+    (void) execute_compound_command(group);
+}
+
+/**
+ * execute_subshell runs the list in a forked child so that changes
+ * such as cd do not affect the shell. When the shell is about to exit
+ * anyway the list runs in this process instead.
+ **/
+void
+execute_subshell(char *list, char *redirections) {
+    pid_t child;
+    int status;
+
+    if (execute_in_place) {
+        if ((status = apply_group_redirections(redirections)) != 0) {
+            previous_exit_code = status;
+            return;
+        }
+
+        (void) adopt_standard_descriptors();
+        (void) execute_list(list);
+        return;
+    }
+
+    if ((child = fork_child()) < 0) {
+        print_error("Could not fork a child", 1);
+        previous_exit_code = 127;
+        return;
+    } else if (child == 0) {
+        if ((status = apply_group_redirections(redirections)) != 0) {
+            exit(status);
+        }
+
+        (void) adopt_standard_descriptors();
+
+        execute_in_place = 1;
+        (void) execute_list(list);
+        exit(previous_exit_code);
+    }
+
+    (void) wait_for_child(child, &status);
+    previous_exit_code = get_exit_code(status);
+}
+
+/**
+ * execute_brace_group runs the list in the current shell. The group's
+ * redirections are opened once and, for the duration of the group,
+ * become the descriptors reset_file_descriptors restores after each
+ * command, so every command in the group shares them.
+ **/
+void
+execute_brace_group(char *list, char *redirections) {
+    struct saved_descriptors saved;
+    int status, first_substitution;
+
+    if (is_blank_string(redirections)) {
+        (void) execute_list(list);
+        return;
+    }
+
+    saved.input = default_standard_input;
+    saved.output = default_standard_output;
+    first_substitution = process_substitution_count;
+
+    if ((status = apply_group_redirections(redirections)) != 0) {
+        (void) reset_file_descriptors();
+        (void) finish_process_substitutions(first_substitution);
+        previous_exit_code = status;
+        return;
+    }
+
+    /* Registered so that close_stray_descriptors leaves them open */
+    saved.outer = saved_descriptors;
+    saved_descriptors = &saved;
+
+    if ((default_standard_input = duplicate_shell_descriptor(STDIN_FILENO)) < 0 ||
+        (default_standard_output = duplicate_shell_descriptor(STDOUT_FILENO)) < 0) {
+        print_error("Could not duplicate file descriptor", 1);
+        exit(127);
+    }
+
+    (void) execute_list(list);
+
+    saved_descriptors = saved.outer;
+
+    (void) close(default_standard_input);
+    (void) close(default_standard_output);
+    default_standard_input = saved.input;
+    default_standard_output = saved.output;
+
+    (void) reset_file_descriptors();
+    (void) finish_process_substitutions(first_substitution);
+}
+
+/**
+ * apply_group_redirections applies the redirections following a group
+ * to the current process. Anything other than a redirection there is
+ * a syntax error.
+ **/
+int
+apply_group_redirections(char *redirections) {
+    char **tokens, *expanded;
+    int token_count, status;
+
+    if (is_blank_string(redirections)) {
+        return 0;
+    }
+
+    expanded = NULL;
+
+    if (strstr(redirections, "<(") != NULL || strstr(redirections, ">(") != NULL) {
+        if ((expanded = expand_process_substitutions(redirections)) == NULL) {
+            return 127;
+        }
+        redirections = expanded;
+    }
+
+    if ((tokens = tokenize_command(redirections, &token_count)) == NULL) {
+        (void) free(expanded);
+        return 127;
+    }
+
+    if (replace_dollars_in_tokens(&tokens, &token_count) != 0) {
+        status = 127;
+    } else if ((status = redirect_file_descriptors(tokens, token_count)) == 0 &&
+               tokens[0] != NULL) {
+        errno = 0;
+        print_error("Syntax error: unexpected word after group", 1);
+        status = 127;
+    }
+
+    (void) free(tokens);
+    (void) free(expanded);
+
+    return status;
+}
+
+/**
+ * pipleline_input_commands is executed when the input
+ * contains pipes. We split on the pipes outside of groups and then
+ * connect the stdout to stdin of the following commands
+ * After that the execute_compound_command method is called
+ **/
+void
+pipleline_input_commands(char *input_command) {
+    int index, stdout_pipe[2], stdin_fd, stdout_fd;
+    int command_count, started, failed;
+    pid_t child, *children;
+    int status, *statuses;
+    char **commands;
+
+    /* The shell has to wait for every stage, so it is never replaced */
+    execute_in_place = 0;
+
+    if ((commands = split_top_level(input_command, '|', &command_count)) == NULL) {
+        print_error("Could not allocate memory", 1);
+        previous_exit_code = 127;
+        return;
+    }
+
+    if (input_flags.pipe_stats) {
+        (void) pipeline_with_statistics(commands, command_count);
+
+        for (index = 0; index < command_count; index++) {
+            (void) free(commands[index]);
+        }
+        (void) free(commands);
+        return;
+    }
+
+    children = malloc(command_count * sizeof(pid_t));
+    statuses = malloc(command_count * sizeof(int));
+
+    /* The first stage reads and the last stage writes the shell's own
+       stdin/stdout, so only the pipes between stages are created */
+    stdin_fd = STDIN_FILENO;
+    stdout_pipe[0] = -1;
+    started = 0;
+    failed = 0;
+
+    if (children == NULL || statuses == NULL) {
+        print_error("Could not allocate memory", 1);
+        failed = 1;
+    }
+
+    for (index = 0; !failed && index < command_count; index++) {
+        if ((command_count - index) == 1) {
+            stdout_pipe[0] = -1;
+            stdout_fd = STDOUT_FILENO;
+        } else if (pipe2(stdout_pipe, O_CLOEXEC)) {
+            print_error("Could not create a pipe", 1);
+            failed = 1;
+            break;
+        } else {
+            stdout_fd = stdout_pipe[1];
+        }
+
+        if ((child = fork_child()) < 0) {
+            print_error("Could not fork a child", 1);
+            if (stdout_fd != STDOUT_FILENO) {
+                (void) close(stdout_fd);
+                (void) close(stdout_pipe[0]);
+            }
+            failed = 1;
+            break;
+        } else if (child == 0) {
+            if (stdin_fd != STDIN_FILENO) {
+                if (dup2(stdin_fd, STDIN_FILENO) != STDIN_FILENO) {
+                    fprintf(stderr, "Could not duplicate fd: %s \n", strerror(errno));
+                    exit(127);
+                }
+                (void) close(stdin_fd);
+            }
+
+            if (stdout_fd != STDOUT_FILENO) {
+                if (dup2(stdout_fd, STDOUT_FILENO) != STDOUT_FILENO) {
+                    fprintf(stderr, "Could not duplicate fd: %s \n", strerror(errno));
+                    exit(127);
+                }
+                (void) close(stdout_fd);
+                (void) close(stdout_pipe[0]);
+            }
+
+            (void) adopt_standard_descriptors();
+
+            if (pipeline_cpu_count > 0 &&
+                set_cpu_affinity(&pipeline_cpus[index % pipeline_cpu_count], 1) != 0) {
+                print_error("sched: Could not set cpu affinity", 0);
+            }
+
+            execute_in_place = 1;
+            (void) execute_compound_command(commands[index]);
+            exit(previous_exit_code);
+        } else {
+            if (stdout_fd != STDOUT_FILENO) {
+                (void) close(stdout_fd);
+            }
+            if (stdin_fd != STDIN_FILENO) {
+                (void) close(stdin_fd);
+            }
+            children[index] = child;
+            started++;
+
+            /*Assign the read end of the pipe to stdin of the following command*/
+            stdin_fd = stdout_pipe[0];
+        }
+    }
+
+    /* The stages already started see end of file once the pipe to the
+       next one is closed, so they finish and are reaped as usual */
+    if (failed && stdin_fd != STDIN_FILENO) {
+        (void) close(stdin_fd);
+    }
+
+    /* All stages run concurrently and are only waited for at the end */
+    for (index = 0; index < started; index++) {
+        (void) wait_for_child(children[index], &status);
+        statuses[index] = get_exit_code(status);
+    }
+
+    if (failed) {
+        previous_exit_code = 127;
+    } else {
+        (void) finish_pipeline(statuses, command_count);
+    }
+
+    (void) free(children);
+    (void) free(statuses);
+
+    for (index = 0; index < command_count; index++) {
+        (void) free(commands[index]);
+    }
+    (void) free(commands);
+}
+
+/**
+ * finish_pipeline records the exit code of every stage in PIPESTATUS and
+ * sets $? to the last stage's code or, with pipefail, to the code of the
+ * last stage that failed.
+ **/
+void
+finish_pipeline(int *statuses, int count) {
+    int index;
+
+    previous_exit_code = statuses[count - 1];
+
+    if (input_flags.pipefail) {
+        for (index = count - 1; index >= 0; index--) {
+            if (statuses[index] != 0) {
+                previous_exit_code = statuses[index];
+                break;
+            }
+        }
+    }
+
+    if (set_status_variable("PIPESTATUS", statuses, count) != 0) {
+        print_error("Could not allocate memory", 1);
+    }
+}
+
+/**
+ * pipeline_with_statistics runs the pipeline with the shell relaying the
+ * data between every pair of stages, and after the last stage, so that it
+ * can count the bytes each stage produces and how long each pipe sat
+ * empty (waiting on the stage) or full (waiting on the next stage). The
+ * per stage report, including CPU time and exit code, goes to stderr once
+ * every stage has exited.
+ **/
+void
+pipeline_with_statistics(char **commands, int command_count) {
+    struct pipeline_stage *stages;
+    struct pollfd *poll_fds;
+    struct sigaction ignore_action, saved_action;
+    int index, other, stage_input, output_pipe[2], input_pipe[2], relay_output;
+    int open_relays, poll_count, *statuses;
+    double start, before_poll, waited;
+    pid_t child;
+
+    poll_fds = NULL;
+    statuses = NULL;
+
+    if ((stages = calloc(command_count, sizeof(struct pipeline_stage))) == NULL ||
+        (poll_fds = malloc(command_count * sizeof(struct pollfd))) == NULL ||
+        (statuses = malloc(command_count * sizeof(int))) == NULL) {
+        print_error("Could not allocate memory", 1);
+        (void) free(stages);
+        (void) free(poll_fds);
+        previous_exit_code = 127;
+        return;
+    }
+
+    start = monotonic_seconds();
+    stage_input = STDIN_FILENO;
+
+    for (index = 0; index < command_count; index++) {
+        stages[index].input_fd = -1;
+        stages[index].output_fd = -1;
+        output_pipe[0] = output_pipe[1] = -1;
+        input_pipe[0] = relay_output = -1;
+
+        if (pipe2(output_pipe, O_CLOEXEC)) {
+            print_error("Could not create a pipe", 1);
+            break;
+        }
+
+        /* The relay writes the stage's output to the next stage's pipe,
+           or to the shell's stdout after the last stage */
+        if (index < command_count - 1) {
+            if (pipe2(input_pipe, O_CLOEXEC)) {
+                input_pipe[0] = -1;
+                print_error("Could not create a pipe", 1);
+                break;
+            }
+            relay_output = input_pipe[1];
+            (void) fcntl(input_pipe[1], F_SETFL, O_NONBLOCK);
+        } else if ((relay_output = duplicate_shell_descriptor(STDOUT_FILENO)) < 0) {
+            print_error("Could not duplicate file descriptor", 1);
+            break;
+        }
+
+        if ((child = fork_child()) < 0) {
+            print_error("Could not fork a child", 1);
+            break;
+        } else if (child == 0) {
+            if (dup2(stage_input, STDIN_FILENO) != STDIN_FILENO ||
+                dup2(output_pipe[1], STDOUT_FILENO) != STDOUT_FILENO) {
+                fprintf(stderr, "Could not duplicate fd: %s \n", strerror(errno));
+                exit(127);
+            }
+
+            /* A stage holding a relay end would keep pipes from closing */
+            for (other = 0; other < index; other++) {
+                (void) close(stages[other].input_fd);
+                (void) close(stages[other].output_fd);
+            }
+
+            if (index < command_count - 1) {
+                (void) close(input_pipe[0]);
+            }
+            (void) close(output_pipe[0]);
+            (void) close(relay_output);
+            (void) close(output_pipe[1]);
+            (void) adopt_standard_descriptors();
+
+            if (pipeline_cpu_count > 0 &&
+                set_cpu_affinity(&pipeline_cpus[index % pipeline_cpu_count], 1) != 0) {
+                print_error("sched: Could not set cpu affinity", 0);
+            }
+
+            execute_in_place = 1;
+            (void) execute_compound_command(commands[index]);
+            exit(previous_exit_code);
+        }
+
+        stages[index].pid = child;
+        stages[index].input_fd = output_pipe[0];
+        stages[index].output_fd = relay_output;
+        stages[index].command = commands[index];
+        (void) close(output_pipe[1]);
+        if (stage_input != STDIN_FILENO) {
+            (void) close(stage_input);
+        }
+
+        if (index < command_count - 1) {
+            stage_input = input_pipe[0];
+        }
+    }
+
+    if (index < command_count) {
+        /* Whatever was set up for the stage that failed to start */
+        if (output_pipe[0] >= 0) {
+            (void) close(output_pipe[0]);
+            (void) close(output_pipe[1]);
+        }
+        if (input_pipe[0] >= 0) {
+            (void) close(input_pipe[0]);
+        }
+        if (relay_output >= 0) {
+            (void) close(relay_output);
+        }
+        if (stage_input != STDIN_FILENO) {
+            (void) close(stage_input);
+        }
+
+        (void) close_pipeline_relays(stages, index);
+        for (other = 0; other < index; other++) {
+            (void) waitpid(stages[other].pid, NULL, 0);
+        }
+
+        (void) free(stages);
+        (void) free(poll_fds);
+        (void) free(statuses);
+        previous_exit_code = 127;
+        return;
+    }
+
+    /* A stage exiting early must not take the relaying shell with it */
+    (void) memset(&ignore_action, 0, sizeof(ignore_action));
+    ignore_action.sa_handler = SIG_IGN;
+    (void) sigemptyset(&ignore_action.sa_mask);
+    (void) sigaction(SIGPIPE, &ignore_action, &saved_action);
+
+    open_relays = command_count;
+
+    while (open_relays > 0) {
+        poll_count = 0;
+
+        for (index = 0; index < command_count; index++) {
+            if (stages[index].buffered > 0) {
+                poll_fds[poll_count].fd = stages[index].output_fd;
+                poll_fds[poll_count].events = POLLOUT;
+            } else if (stages[index].input_fd >= 0) {
+                poll_fds[poll_count].fd = stages[index].input_fd;
+                poll_fds[poll_count].events = POLLIN;
+            } else {
+                continue;
+            }
+            poll_fds[poll_count].revents = 0;
+            stages[index].poll_index = poll_count++;
+        }
+
+        before_poll = monotonic_seconds();
+
+        if (poll(poll_fds, poll_count, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            print_error("Could not poll pipeline", 1);
+            break;
+        }
+
+        waited = monotonic_seconds() - before_poll;
+        shell_statistics.wait_seconds += waited;
+
+        for (index = 0; index < command_count; index++) {
+            if (stages[index].input_fd < 0 && stages[index].buffered == 0) {
+                continue;
+            }
+
+            if (stages[index].buffered > 0) {
+                stages[index].full_seconds += waited;
+            } else {
+                stages[index].empty_seconds += waited;
+            }
+
+            if (poll_fds[stages[index].poll_index].revents == 0) {
+                continue;
+            }
+
+            if (relay_stage_output(&stages[index]) != 0) {
+                stages[index].wall_seconds = monotonic_seconds() - start;
+                (void) close(stages[index].output_fd);
+                stages[index].output_fd = -1;
+                open_relays--;
+            }
+        }
+    }
+
+    (void) sigaction(SIGPIPE, &saved_action, NULL);
+
+    /* Only left open when polling failed, the stages must not block on them */
+    (void) close_pipeline_relays(stages, command_count);
+
+    before_poll = monotonic_seconds();
+
+    for (index = 0; index < command_count; index++) {
+        (void) wait4(stages[index].pid, &stages[index].status, 0, &stages[index].usage);
+        stages[index].status = get_exit_code(stages[index].status);
+        statuses[index] = stages[index].status;
+    }
+
+    shell_statistics.wait_seconds += monotonic_seconds() - before_poll;
+
+    (void) print_pipeline_statistics(stages, command_count);
+    (void) finish_pipeline(statuses, command_count);
+
+    (void) free(stages);
+    (void) free(poll_fds);
+    (void) free(statuses);
+}
+
+/**
+ * close_pipeline_relays closes the relay ends still open for the first
+ * count stages, so those stages see end of file or EPIPE and exit.
+ **/
+void
+close_pipeline_relays(struct pipeline_stage *stages, int count) {
+    int index;
+
+    for (index = 0; index < count; index++) {
+        if (stages[index].input_fd >= 0) {
+            (void) close(stages[index].input_fd);
+            stages[index].input_fd = -1;
+        }
+        if (stages[index].output_fd >= 0) {
+            (void) close(stages[index].output_fd);
+            stages[index].output_fd = -1;
+        }
+        stages[index].buffered = 0;
+    }
+}
+
+/**
+ * relay_stage_output moves data from a stage to whatever follows it,
+ * reading only once the previous chunk has been written. Returns 1 once
+ * the relay is finished, either because the stage closed its output and
+ * everything has been passed on or because the reader went away.
+ **/
+int
+relay_stage_output(struct pipeline_stage *stage) {
+    ssize_t bytes;
+
+    if (stage->buffered == 0) {
+        if ((bytes = read(stage->input_fd, stage->buffer, sizeof(stage->buffer))) > 0) {
+            stage->buffered = bytes;
+            stage->offset = 0;
+            stage->bytes += bytes;
+            return 0;
+        }
+
+        if (bytes < 0 && (errno == EINTR || errno == EAGAIN)) {
+            return 0;
+        }
+
+        (void) close(stage->input_fd);
+        stage->input_fd = -1;
+
+        return 1;
+    }
+
+    if ((bytes = write(stage->output_fd, stage->buffer + stage->offset, stage->buffered)) < 0) {
+        if (errno == EINTR || errno == EAGAIN) {
+            return 0;
+        }
+
+        /* The next stage is gone, closing our end lets this stage see EPIPE */
+        (void) close(stage->input_fd);
+        stage->input_fd = -1;
+        stage->buffered = 0;
+
+        return 1;
+    }
+
+    stage->offset += bytes;
+    stage->buffered -= bytes;
+
+    return stage->buffered == 0 && stage->input_fd < 0;
+}
+
+void
+print_pipeline_statistics(struct pipeline_stage *stages, int count) {
+    struct pipeline_stage *stage;
+    int index;
+
+    fprintf(stderr, "%s: pipeline statistics\n", getprogname());
+    fprintf(stderr, "%5s %6s %12s %10s %8s %8s %8s %8s %8s  %s\n", "stage", "status",
+            "bytes", "MB/s", "wall", "user", "sys", "empty", "full", "command");
+
+    for (index = 0; index < count; index++) {
+        stage = &stages[index];
+        fprintf(stderr, "%5i %6i %12lu %10.2f %8.3f %8.3f %8.3f %8.3f %8.3f  %s\n",
+                index + 1, stage->status, stage->bytes,
+                stage->wall_seconds > 0 ? stage->bytes / stage->wall_seconds / 1e6 : 0.0,
+                stage->wall_seconds,
+                stage->usage.ru_utime.tv_sec + stage->usage.ru_utime.tv_usec / 1e6,
+                stage->usage.ru_stime.tv_sec + stage->usage.ru_stime.tv_usec / 1e6,
+                stage->empty_seconds, stage->full_seconds, stage->command);
+    }
+}
+
+double
+monotonic_seconds() {
+    struct timespec now;
+
+    (void) clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+/**
+ * perform_set turns shell options on (-o name) and off (+o name). With
+ * no arguments, or -o alone, the current options are listed.
+ **/
+int
+perform_set(char **tokens, int token_count) {
+    int index, value, *option;
+
+    if (token_count == 1 || (token_count == 2 && strcmp(tokens[1], "-o") == 0)) {
+        fprintf(stdout, "argbatch\t%s\n", input_flags.arg_batch ? "on" : "off");
+        fprintf(stdout, "pipefail\t%s\n", input_flags.pipefail ? "on" : "off");
+        fprintf(stdout, "pipestats\t%s\n", input_flags.pipe_stats ? "on" : "off");
+        fprintf(stdout, "xtrace\t\t%s\n", input_flags.x_flag ? "on" : "off");
+        return 0;
+    }
+
+    for (index = 1; index < token_count; index++) {
+        if (strcmp(tokens[index], "-x") == 0 || strcmp(tokens[index], "+x") == 0) {
+            input_flags.x_flag = tokens[index][0] == '-';
+            continue;
+        }
+
+        if ((strcmp(tokens[index], "-o") != 0 && strcmp(tokens[index], "+o") != 0) ||
+            index + 1 == token_count) {
+            fprintf(stderr, "set: Usage: set [-x | +x] [-o option | +o option]\n");
+            return 2;
+        }
+
+        value = tokens[index][0] == '-';
+        index++;
+
+        if (strcmp(tokens[index], "argbatch") == 0) {
+            option = &input_flags.arg_batch;
+        } else if (strcmp(tokens[index], "pipefail") == 0) {
+            option = &input_flags.pipefail;
+        } else if (strcmp(tokens[index], "pipestats") == 0) {
+            option = &input_flags.pipe_stats;
+        } else if (strcmp(tokens[index], "xtrace") == 0) {
+            option = &input_flags.x_flag;
+        } else {
+            fprintf(stderr, "set: %s: invalid option name\n", tokens[index]);
+            return 2;
+        }
+
+        *option = value;
+    }
+
+    return 0;
+}
+
+/**
+ * split_top_level splits line on every occurrence of separator that is
+ * not nested inside a group. The pieces are returned as a newly
+ * allocated array with their count stored in count.
+ **/
+char **
+split_top_level(char *line, char separator, int *count) {
+    char **pieces;
+    int index, start, depth, piece_count;
+
+    piece_count = 1;
+    depth = 0;
+
+    for (index = 0; line[index] != '\0'; index++) {
+        if ((depth = update_group_depth(line, index, depth)) == 0 &&
+            line[index] == separator) {
+            piece_count++;
+        }
+    }
+
+    if ((pieces = malloc(piece_count * sizeof(char *))) == NULL) {
+        return NULL;
+    }
+
+    *count = 0;
+    start = 0;
+    depth = 0;
+
+    for (index = 0; ; index++) {
+        if (line[index] != '\0') {
+            depth = update_group_depth(line, index, depth);
+            if (depth != 0 || line[index] != separator) {
+                continue;
+            }
+        }
+
+        if ((pieces[*count] = malloc(index - start + 1)) == NULL) {
+            while ((*count)-- > 0) {
+                (void) free(pieces[*count]);
+            }
+            (void) free(pieces);
+            return NULL;
+        }
+
+        (void) memcpy(pieces[*count], line + start, index - start);
+        pieces[*count][index - start] = '\0';
+        (*count)++;
+        start = index + 1;
+
+        if (line[index] == '\0') {
+            break;
+        }
+    }
+
+    return pieces;
+}
+
+/**
+ * run_server keeps the shell resident on a unix domain socket. Every
+ * connection carries one command along with the client's stdin, stdout,
+ * stderr and working directory (passed as SCM_RIGHTS). The request is
+ * read and run in a child forked from the warm server, so a client that
+ * stalls cannot hold up the others, and its exit status is written back
+ * on the connection once the child has been reaped.
+ **/
+int
+run_server(char *socket_path) {
+    struct sockaddr_un address;
+    struct server_worker *workers, *grown_workers;
+    struct sigaction child_action;
+    struct stat socket_stat;
+    sigset_t child_mask, wait_mask;
+    fd_set read_set;
+    int listen_fd, connection, worker_count, worker_capacity, index, status;
+    int request_fds[SERVER_FD_COUNT], x_flag;
+    char *command;
+    pid_t child;
+
+    workers = NULL;
+    worker_count = 0;
+    worker_capacity = 0;
+
+    if (create_unix_address(&address, socket_path) != 0) {
+        return 1;
+    }
+
+    if ((listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0) {
+        print_error("Could not create socket", 1);
+        return 1;
+    }
+
+    /* Only a stale socket is replaced, never some other file */
+    if (lstat(socket_path, &socket_stat) == 0) {
+        if (!S_ISSOCK(socket_stat.st_mode)) {
+            errno = 0;
+            print_error("Socket path exists and is not a socket", 1);
+            return 1;
+        }
+        (void) unlink(socket_path);
+    }
+
+    if (bind(listen_fd, (struct sockaddr *) &address, sizeof(address)) < 0) {
+        print_error("Could not bind socket", 1);
+        return 1;
+    }
+
+    if (listen(listen_fd, SOMAXCONN) < 0) {
+        print_error("Could not listen on socket", 1);
+        return 1;
+    }
+
+    /* SIGCHLD stays blocked except while waiting in pselect, so a child
+       exiting between the reap loop and pselect cannot be missed */
+    (void) memset(&child_action, 0, sizeof(child_action));
+    child_action.sa_handler = handle_sig_child;
+    (void) sigemptyset(&child_action.sa_mask);
+
+    if (sigaction(SIGCHLD, &child_action, NULL) < 0) {
+        print_error("Could not register signal", 1);
+        return 1;
+    }
+
+    (void) sigemptyset(&child_mask);
+    (void) sigaddset(&child_mask, SIGCHLD);
+
+    if (sigprocmask(SIG_BLOCK, &child_mask, &wait_mask) < 0) {
+        print_error("Could not block signal", 1);
+        return 1;
+    }
+
+    (void) sigdelset(&wait_mask, SIGCHLD);
+    (void) signal(SIGPIPE, SIG_IGN);
+
+    for (;;) {
+        while ((child = waitpid(-1, &status, WNOHANG)) > 0) {
+            for (index = 0; index < worker_count; index++) {
+                if (workers[index].pid != child) {
+                    continue;
+                }
+
+                status = get_exit_code(status);
+                (void) write_exact(workers[index].connection, &status, sizeof(status));
+                (void) close(workers[index].connection);
+                workers[index] = workers[worker_count - 1];
+                worker_count--;
+                break;
+            }
+        }
+
+        FD_ZERO(&read_set);
+        FD_SET(listen_fd, &read_set);
+
+        if (pselect(listen_fd + 1, &read_set, NULL, NULL, NULL, &wait_mask) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            print_error("Could not wait for connections", 1);
+            return 1;
+        }
+
+        if ((connection = accept(listen_fd, NULL, NULL)) < 0) {
+            continue;
+        }
+        (void) fcntl(connection, F_SETFD, FD_CLOEXEC);
+
+        if (worker_count == worker_capacity) {
+            worker_capacity = worker_capacity ? worker_capacity * 2 : 16;
+            if ((grown_workers = realloc(workers,
+                    worker_capacity * sizeof(struct server_worker))) == NULL) {
+                print_error("Could not allocate memory", 1);
+                return 1;
+            }
+            workers = grown_workers;
+        }
+
+        if ((child = fork_child()) < 0) {
+            print_error("Could not fork a child", 1);
+            status = 127;
+            (void) write_exact(connection, &status, sizeof(status));
+            (void) close(connection);
+        } else if (child == 0) {
+            (void) close(listen_fd);
+            (void) signal(SIGPIPE, SIG_DFL);
+            (void) sigprocmask(SIG_SETMASK, &wait_mask, NULL);
+            if (receive_server_request(connection, request_fds, &command, &x_flag) != 0) {
+                exit(127);
+            }
+            (void) close(connection);
+            (void) serve_request(request_fds, command, x_flag);
+            exit(previous_exit_code);
+        } else {
+            workers[worker_count].pid = child;
+            workers[worker_count].connection = connection;
+            worker_count++;
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * serve_request runs inside the forked worker. It installs the client's
+ * descriptors and directory and then executes the command exactly as
+ * -c would, letting a simple command replace the worker.
+ **/
+void
+serve_request(int *request_fds, char *command, int x_flag) {
+    int index;
+
+    for (index = 0; index < 3; index++) {
+        if (dup2(request_fds[index], index) != index) {
+            print_error("Could not duplicate file descriptor", 1);
+            exit(127);
+        }
+    }
+
+    if (fchdir(request_fds[3]) < 0) {
+        print_error("cd: Could not change directory", 0);
+        exit(127);
+    }
+
+    for (index = 0; index < SERVER_FD_COUNT; index++) {
+        (void) close(request_fds[index]);
+    }
+
+    (void) adopt_standard_descriptors();
+
+    input_flags.x_flag = x_flag;
+    execute_in_place = 1;
+    (void) execute_input_line(command);
+}
+
+/**
+ * receive_server_request reads the request header along with the
+ * descriptors passed by the client and then the command itself. On any
+ * error the descriptors that did arrive are closed again.
+ **/
+int
+receive_server_request(int connection, int *request_fds, char **command, int *x_flag) {
+    struct server_request request;
+    struct msghdr message;
+    struct cmsghdr *control_header;
+    struct iovec vector;
+    union {
+        struct cmsghdr header;
+        char buffer[CMSG_SPACE(SERVER_FD_COUNT * sizeof(int))];
+    } control;
+    ssize_t received;
+    int index;
+
+    (void) memset(&message, 0, sizeof(message));
+    (void) memset(&control, 0, sizeof(control));
+    vector.iov_base = &request;
+    vector.iov_len = sizeof(request);
+    message.msg_iov = &vector;
+    message.msg_iovlen = 1;
+    message.msg_control = control.buffer;
+    message.msg_controllen = sizeof(control.buffer);
+
+    errno = 0;
+    if ((received = recvmsg(connection, &message, MSG_CMSG_CLOEXEC)) < 0) {
+        print_error("Could not receive request", 1);
+        return 1;
+    }
+
+    control_header = CMSG_FIRSTHDR(&message);
+
+    if (received != sizeof(request) || (message.msg_flags & MSG_CTRUNC) ||
+        control_header == NULL || control_header->cmsg_level != SOL_SOCKET ||
+        control_header->cmsg_type != SCM_RIGHTS ||
+        control_header->cmsg_len != CMSG_LEN(SERVER_FD_COUNT * sizeof(int))) {
+        close_received_descriptors(&message);
+        errno = 0;
+        print_error("Malformed request", 1);
+        return 1;
+    }
+
+    (void) memcpy(request_fds, CMSG_DATA(control_header), SERVER_FD_COUNT * sizeof(int));
+
+    if (request.command_length >= ARG_MAX) {
+        errno = 0;
+        print_error("Request command is too long", 1);
+    } else if ((*command = malloc(request.command_length + 1)) == NULL) {
+        print_error("Could not allocate memory", 1);
+    } else {
+        errno = 0;
+        if (read_exact(connection, *command, request.command_length) == 0) {
+            (*command)[request.command_length] = '\0';
+            *x_flag = request.x_flag;
+            return 0;
+        }
+        print_error("Could not receive request", 1);
+        (void) free(*command);
+    }
+
+    for (index = 0; index < SERVER_FD_COUNT; index++) {
+        (void) close(request_fds[index]);
+    }
+    return 1;
+}
+
+/**
+ * close_received_descriptors closes every descriptor that arrived with
+ * a message, including those of a truncated or unexpected control
+ * message.
+ **/
+void
+close_received_descriptors(struct msghdr *message) {
+    struct cmsghdr *control_header;
+    int fd;
+    size_t offset;
+
+    for (control_header = CMSG_FIRSTHDR(message); control_header != NULL;
+         control_header = CMSG_NXTHDR(message, control_header)) {
+        if (control_header->cmsg_level != SOL_SOCKET ||
+            control_header->cmsg_type != SCM_RIGHTS) {
+            continue;
+        }
+        for (offset = CMSG_LEN(0); offset + sizeof(int) <= control_header->cmsg_len;
+             offset += sizeof(int)) {
+            (void) memcpy(&fd, (char *) control_header + offset, sizeof(fd));
+            (void) close(fd);
+        }
+    }
+}
+
+/**
+ * run_client sends a single command to a resident server together with
+ * this process's stdin, stdout, stderr and working directory, and exits
+ * with the status the server reports back.
+ **/
+int
+run_client(char *socket_path, char *command) {
+    struct sockaddr_un address;
+    struct server_request request;
+    struct msghdr message;
+    struct cmsghdr *control_header;
+    struct iovec vector;
+    union {
+        struct cmsghdr header;
+        char buffer[CMSG_SPACE(SERVER_FD_COUNT * sizeof(int))];
+    } control;
+    int connection, status, request_fds[SERVER_FD_COUNT];
+
+    if (create_unix_address(&address, socket_path) != 0) {
+        return 127;
+    }
+
+    if ((connection = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0) {
+        print_error("Could not create socket", 1);
+        return 127;
+    }
+
+    if (connect(connection, (struct sockaddr *) &address, sizeof(address)) < 0) {
+        print_error("Could not connect to server", 1);
+        return 127;
+    }
+
+    if ((request_fds[3] = open(".", O_RDONLY | O_CLOEXEC)) < 0) {
+        print_error("Could not open current directory", 1);
+        return 127;
+    }
+
+    request_fds[0] = STDIN_FILENO;
+    request_fds[1] = STDOUT_FILENO;
+    request_fds[2] = STDERR_FILENO;
+
+    (void) memset(&request, 0, sizeof(request));
+    request.command_length = strlen(command);
+    request.x_flag = input_flags.x_flag;
+
+    (void) memset(&message, 0, sizeof(message));
+    (void) memset(&control, 0, sizeof(control));
+    vector.iov_base = &request;
+    vector.iov_len = sizeof(request);
+    message.msg_iov = &vector;
+    message.msg_iovlen = 1;
+    message.msg_control = control.buffer;
+    message.msg_controllen = sizeof(control.buffer);
+
+    control_header = CMSG_FIRSTHDR(&message);
+    control_header->cmsg_level = SOL_SOCKET;
+    control_header->cmsg_type = SCM_RIGHTS;
+    control_header->cmsg_len = CMSG_LEN(SERVER_FD_COUNT * sizeof(int));
+    (void) memcpy(CMSG_DATA(control_header), request_fds, SERVER_FD_COUNT * sizeof(int));
+
+    if (sendmsg(connection, &message, 0) != sizeof(request) ||
+        write_exact(connection, command, request.command_length) != 0) {
+        print_error("Could not send request", 1);
+        return 127;
+    }
+
+    (void) close(request_fds[3]);
+
+    if (read_exact(connection, &status, sizeof(status)) != 0) {
+        print_error("Server closed the connection", 1);
+        return 127;
+    }
+
+    (void) close(connection);
+
+    return status;
+}
+
+int
+create_unix_address(struct sockaddr_un *address, char *socket_path) {
+    (void) memset(address, 0, sizeof(*address));
+    address->sun_family = AF_UNIX;
+
+    if (strlen(socket_path) >= sizeof(address->sun_path)) {
+        errno = 0;
+        print_error("Socket path is too long", 1);
+        return 1;
+    }
+
+    (void) strcpy(address->sun_path, socket_path);
+
+    return 0;
+}
+
+int
+read_exact(int fd, void *buffer, size_t length) {
+    ssize_t bytes;
+    size_t done;
+
+    for (done = 0; done < length; done += bytes) {
+        if ((bytes = read(fd, (char *) buffer + done, length - done)) <= 0) {
+            if (bytes < 0 && errno == EINTR) {
+                bytes = 0;
+                continue;
+            }
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+int
+write_exact(int fd, void *buffer, size_t length) {
+    ssize_t bytes;
+    size_t done;
+
+    for (done = 0; done < length; done += bytes) {
+        if ((bytes = write(fd, (char *) buffer + done, length - done)) < 0) {
+            if (errno == EINTR) {
+                bytes = 0;
+                continue;
+            }
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * get_exit_code converts a wait status into the value reported as $?,
+ * using the 128 + signal convention for children killed by a signal.
+ **/
+int
+get_exit_code(int status) {
+    if (WIFEXITED(status)) {
+        return WEXITSTATUS(status);
+    }
+
+    if (WIFSIGNALED(status)) {
+        return 128 + WTERMSIG(status);
+    }
+
+    return status;
+}
+
+void
+print_usage() {
+    fprintf(stderr, "%s: Usage: sish [-c command] [-x]\n", getprogname());
+    fprintf(stderr, "       sish --server socket\n");
+    fprintf(stderr, "       sish --client socket [-x] -c command\n");
+    fprintf(stderr, "       sish --record file [-x] [-c command]\n");
+    fprintf(stderr, "       sish --replay file [--record file] [-x]\n");
+}
+
+/**
+ * strip_new_line will remove the '\n' at the end of the string. getline includes
+ * '\n' which is not the user command but due to pressing enter to execute the command.
+ * Hence we need to strip it before performing further processing on the input.
+ **/
+void
+strip_new_line(char *input) {
+    int input_length;
+
+    input_length = strlen(input);
+    if (input[input_length - 1] == '\n') {
+        input[input_length - 1] = '\0';
+    }
+}
+
+/**
+ * expand_process_substitutions starts the command of every <(cmd) and
+ * >(cmd) in the input on its own pipe and returns a copy of the input
+ * where each substitution is replaced by the /dev/fd path of the shell's
+ * end of that pipe. The inner commands run concurrently with the outer
+ * one and are collected by finish_process_substitutions.
+ **/
+char *
+expand_process_substitutions(char *command) {
+    char *expanded, *inner;
+    int index, end, depth, length, expanded_length, substitution_fd;
+
+    length = strlen(command);
+
+    /* Every substitution is at least "<()" long and becomes /dev/fd/N */
+    if ((expanded = malloc(length + (length / 4 + 1) * 24 + 1)) == NULL) {
+        print_error("Could not allocate memory", 1);
+        return NULL;
+    }
+
+    expanded_length = 0;
+    index = 0;
+
+    while (index < length) {
+        if ((command[index] != '<' && command[index] != '>') || command[index + 1] != '(') {
+            expanded[expanded_length++] = command[index++];
+            continue;
+        }
+
+        depth = 1;
+        for (end = index + 2; end < length && depth > 0; end++) {
+            if (command[end] == '(') {
+                depth++;
+            } else if (command[end] == ')') {
+                depth--;
+            }
+        }
+
+        if (depth != 0) {
+            errno = 0;
+            print_error("Syntax error: unterminated process substitution", 1);
+            (void) free(expanded);
+            return NULL;
+        }
+
+        /* end is one past the closing parenthesis */
+        if ((inner = malloc(end - index - 2)) == NULL) {
+            print_error("Could not allocate memory", 1);
+            (void) free(expanded);
+            return NULL;
+        }
+
+        (void) memcpy(inner, command + index + 2, end - index - 3);
+        inner[end - index - 3] = '\0';
+
+        substitution_fd = start_process_substitution(inner, command[index] == '<');
+        (void) free(inner);
+
+        if (substitution_fd < 0) {
+            (void) free(expanded);
+            return NULL;
+        }
+
+        expanded_length += sprintf(expanded + expanded_length, "/dev/fd/%d", substitution_fd);
+        index = end;
+    }
+
+    expanded[expanded_length] = '\0';
+
+    return expanded;
+}
+
+/**
+ * start_process_substitution forks the inner command with its stdout
+ * (for <(cmd)) or stdin (for >(cmd)) connected to a new pipe and
+ * returns the end of the pipe the outer command should use.
+ **/
+int
+start_process_substitution(char *inner_command, int read_output) {
+    struct process_substitution *grown;
+    int substitution_pipe[2], index, child_end;
+    pid_t child;
+
+    if ((grown = realloc(process_substitutions, (process_substitution_count + 1) *
+            sizeof(struct process_substitution))) == NULL) {
+        print_error("Could not allocate memory", 1);
+        return -1;
+    }
+
+    process_substitutions = grown;
+
+    if (pipe2(substitution_pipe, O_CLOEXEC)) {
+        print_error("Could not create a pipe", 1);
+        return -1;
+    }
+
+    /* The shell's end is handed to the command as /dev/fd/N */
+    (void) fcntl(substitution_pipe[read_output ? 0 : 1], F_SETFD, 0);
+
+    child_end = read_output ? STDOUT_FILENO : STDIN_FILENO;
+
+    if ((child = fork_child()) < 0) {
+        print_error("Could not fork a child", 1);
+        (void) close(substitution_pipe[0]);
+        (void) close(substitution_pipe[1]);
+        return -1;
+    } else if (child == 0) {
+        /* Holding on to a sibling's write end would keep its reader
+           from ever seeing end of file */
+        for (index = 0; index < process_substitution_count; index++) {
+            (void) close(process_substitutions[index].fd);
+        }
+
+        if (dup2(substitution_pipe[read_output ? 1 : 0], child_end) != child_end) {
+            fprintf(stderr, "Could not duplicate fd: %s \n", strerror(errno));
+            exit(127);
+        }
+
+        (void) close(substitution_pipe[0]);
+        (void) close(substitution_pipe[1]);
+        (void) adopt_standard_descriptors();
+
+        execute_in_place = 1;
+        (void) execute_input_line(inner_command);
+        exit(previous_exit_code);
+    }
+
+    (void) close(substitution_pipe[read_output ? 1 : 0]);
+
+    process_substitutions[process_substitution_count].pid = child;
+    process_substitutions[process_substitution_count].fd =
+        substitution_pipe[read_output ? 0 : 1];
+    process_substitution_count++;
+
+    return substitution_pipe[read_output ? 0 : 1];
+}
+
+/**
+ * finish_process_substitutions closes the shell's ends of the
+ * substitution pipes started since first, so >(cmd) readers see end
+ * of file, and then waits for the inner commands.
+ **/
+void
+finish_process_substitutions(int first) {
+    int index, status;
+
+    for (index = first; index < process_substitution_count; index++) {
+        (void) close(process_substitutions[index].fd);
+    }
+
+    for (index = first; index < process_substitution_count; index++) {
+        (void) wait_for_child(process_substitutions[index].pid, &status);
+    }
+
+    process_substitution_count = first;
+}
+
+/**
+ * This method is called after we have read the input from the terminal and 
+ * split the input by the pipe
+ **/
+void
+execute_command(char *command) {
+    char **tokens, *expanded;
+    int token_count, redirection_status;
+    int first_substitution;
+    double started, finished;
+
+    token_count = 0;
+
+    if (strlen(command) < 1 && command[0] == '\0') {
+        return;
+    }
+
+    if (strstr(command, "<(") != NULL || strstr(command, ">(") != NULL) {
+        first_substitution = process_substitution_count;
+
+        if ((expanded = expand_process_substitutions(command)) == NULL) {
+            (void) finish_process_substitutions(first_substitution);
+            previous_exit_code = 127;
+            return;
+        }
+
+        (void) execute_command(expanded);
+        (void) finish_process_substitutions(first_substitution);
+        (void) free(expanded);
+        return;
+    }
+
+    shell_statistics.commands++;
+    started = monotonic_seconds();
+
+    if ((tokens = tokenize_command(command, &token_count)) == NULL) {
+        previous_exit_code = 127;
+        return;
+    }
+
+    finished = monotonic_seconds();
+    shell_statistics.lex_seconds += finished - started;
+    started = finished;
+
+    if (replace_dollars_in_tokens(&tokens, &token_count) != 0) {
+        previous_exit_code = 127;
+        return;
+    }
+
+    finished = monotonic_seconds();
+    shell_statistics.expand_seconds += finished - started;
+    started = finished;
+
+    if ((redirection_status = redirect_file_descriptors(tokens, token_count)) != 0) {
+        previous_exit_code = redirection_status;
+        return;
+    }
+
+    shell_statistics.redirect_seconds += monotonic_seconds() - started;
+
+    if (tokens[0] == NULL) {
+        (void) free(tokens);
+        (void) reset_file_descriptors();
+        return;
+    }
+
+    token_count = reiterate_token_count(tokens);
+
+    if (input_flags.x_flag) {
+        if (print_command(tokens, token_count) != 0) {
+            return;
+        }
+    }
+
+    previous_exit_code = run_simple_command(tokens, token_count);
+
+    (void) free(tokens);
+
+    (void) reset_file_descriptors();
+}
+
+/**
+ * run_simple_command runs the builtin named by the first token, or
+ * execs the command, and returns its status. The tokens have already
+ * been expanded and stripped of redirections.
+ **/
+int
+run_simple_command(char **tokens, int token_count) {
+    int index, status, command_length;
+
+    /* Room for echo to join the words with blanks */
+    command_length = 0;
+    for (index = 0; index < token_count; index++) {
+        command_length += strlen(tokens[index]) + 1;
+    }
+
+    if (is_builtin(tokens[0])) {
+        shell_statistics.builtins++;
+    }
+
+    if (strcmp(tokens[0], "cd") == 0) {
+        if (token_count == 1) {
+            status = perform_directory_change(NULL);
+        } else {
+            status = perform_directory_change(tokens[1]);
+        }
+    } else if (strcmp(tokens[0], "echo") == 0) {
+        status = perform_echo(tokens, token_count, command_length);
+    } else if (strcmp(tokens[0], "shstats") == 0) {
+        status = perform_shstats(tokens, token_count);
+    } else if (strcmp(tokens[0], "set") == 0) {
+        status = perform_set(tokens, token_count);
+    } else if (strcmp(tokens[0], "sched") == 0) {
+        status = perform_sched(tokens, token_count);
+    } else if (strcmp(tokens[0], "ulimit") == 0) {
+        status = perform_ulimit(tokens, token_count);
+    } else if (strcmp(tokens[0], "timeout") == 0) {
+        status = perform_timeout(tokens, token_count);
+    } else if (strcmp(tokens[0], "batch") == 0) {
+        status = perform_batch(tokens, token_count);
+    } else if (strcmp(tokens[0], "parallel") == 0) {
+        status = perform_parallel(tokens, token_count);
+    } else if (strcmp(tokens[0], "history") == 0) {
+        status = perform_history(tokens, token_count);
+    } else if (strcmp(tokens[0], "source") == 0 || strcmp(tokens[0], ".") == 0) {
+        status = perform_source(tokens, token_count);
+    } else if (strcmp(tokens[0], "coproc") == 0) {
+        status = perform_coproc(tokens, token_count);
+    } else if (strcmp(tokens[0], "read") == 0) {
+        status = perform_read(tokens, token_count);
+    } else if (strcmp(tokens[0], "mapfile") == 0 || strcmp(tokens[0], "readarray") == 0) {
+        status = perform_mapfile(tokens, token_count);
+    } else {
+        status = perform_exec(tokens);
+    }
+
+    return status;
+}
+
+/**
+ * tokenize_command splits a simple command on blanks and separates the
+ * <, > and >> operators into tokens of their own, even when they are
+ * written without surrounding spaces. The returned array is terminated
+ * by a null pointer.
+ **/
+char **
+tokenize_command(char *command, int *token_count_out) {
+    char *last, *token, **tokens, *command_copy, *temp;
+    int token_count, token_count_estimate, index, command_length;
+    int token_index, token_length;
+
+    index = 0;
+    token_count = 0;
+    command_length = strlen(command);
+
+    if ((token_count_estimate = get_char_count(command, " \t<>")) < 0) {
+        print_error("Could not allocate memory", 1);
+        return NULL;
+    }
+
+    /* Every redirection operator can add a token of its own */
+    for (index = 0; index < command_length; index++) {
+        if (command[index] == '<' || command[index] == '>') {
+            token_count_estimate++;
+        }
+    }
+
+    index = 0;
+
+    if ((tokens = shell_malloc((token_count_estimate + 1) * sizeof(char *))) == NULL) {
+        print_error("Could not allocate memory", 1);
+        return NULL;
+    }
+
+    if ((command_copy = shell_strdup(command)) == NULL) {
+        print_error("Could not allocate memory", 1);
+        (void) free(tokens);
+        return NULL;
+    }
+
+    token = strtok_r(command_copy, " \t", &last);
+
+    while (token != NULL) {
+        if (strcmp(token, ">") == 0 || strcmp(token, ">>") == 0 || strcmp(token, "<") == 0 ) {
+            if ((tokens[index] = shell_strdup(token)) == NULL) {
+                print_error("Could not allocate memory", 1);
+                (void) free(command_copy);
+                (void) free(tokens);
+                return NULL;
+            }
+            token = strtok_r(NULL, " \t", &last);
+            index++;
+            token_count++;
+            continue;
+        }
+
+        if (!(strchr(token, '<') || strchr(token, '>'))) {
+            if ((tokens[index] = shell_strdup(token)) == NULL) {
+                print_error("Could not allocate memory", 1);
+                (void) free(command_copy);
+                (void) free(tokens);
+                return NULL;
+            }
+            index++;
+            token_count++;
+            token = strtok_r(NULL, " \t", &last);
+            continue;
+        }
+
+        /* Only stdin and stdout can be redirected, so the N of N>&M must
+           not silently become an argument */
+        if (is_descriptor_duplication(token)) {
+            errno = 0;
+            print_error("Syntax error: N>&M and N<&M are not supported", 1);
+            (void) free(command_copy);
+            (void) free(tokens);
+            return NULL;
+        }
+
+        token_length = strlen(token);
+
+        if ((temp = shell_malloc(token_length)) == NULL) {
+            print_error("Could not allocate memory", 1);
+            (void) free(command_copy);
+            (void) free(tokens);
+            return NULL;
+        }
 
         temp[0] = '\0';
 
-        for (token_index = 0; token_index < token_length; token_index++) {
-            if (token[token_index] == '>') {
-                if (strlen(temp) > 0) {
-                    if ((tokens[index] = strdup(temp)) == NULL) {
-                        print_error("Could not allocate memory", 1);
-                        previous_exit_code = 127;
-                        return;
-                    }
-                    temp[0] = '\0';
-                    index++;
-                    token_count++;
-                }
-                
-                if ((strlen(token) - token_index) > 1 && token[token_index + 1] == '>') {
-                    tokens[index] = ">>";
-                    index++;
-                    token_index++;
-                } else {
-                    tokens[index] = ">";
-                    index++;
-                }
-                    
-                token_count++;
-            } else if (token[token_index] == '<') {
-                if (strlen(temp) > 0) {
-                    if ((tokens[index] = strdup(temp)) == NULL) {
-                        print_error("Could not allocate memory", 1);
-                        previous_exit_code = 127;
-                        return;
-                    }
-                    temp[0] = '\0';
-                    index++;
-                    token_count++;
-                }
+        for (token_index = 0; token_index < token_length; token_index++) {
+            if (token[token_index] == '>') {
+                if (strlen(temp) > 0) {
+                    if ((tokens[index] = shell_strdup(temp)) == NULL) {
+                        print_error("Could not allocate memory", 1);
+                        (void) free(temp);
+                        (void) free(command_copy);
+                        (void) free(tokens);
+                        return NULL;
+                    }
+                    temp[0] = '\0';
+                    index++;
+                    token_count++;
+                }
+                
+                if ((strlen(token) - token_index) > 1 && token[token_index + 1] == '>') {
+                    tokens[index] = ">>";
+                    index++;
+                    token_index++;
+                } else {
+                    tokens[index] = ">";
+                    index++;
+                }
+                    
+                token_count++;
+            } else if (token[token_index] == '<') {
+                if (strlen(temp) > 0) {
+                    if ((tokens[index] = shell_strdup(temp)) == NULL) {
+                        print_error("Could not allocate memory", 1);
+                        (void) free(temp);
+                        (void) free(command_copy);
+                        (void) free(tokens);
+                        return NULL;
+                    }
+                    temp[0] = '\0';
+                    index++;
+                    token_count++;
+                }
+
+                tokens[index] = "<";
+                index++;
+                token_count++;
+            } else {
+                (void) append_char(temp, token[token_index]);
+            }
+        }
+
+        if (strlen(temp) > 0) {
+            if ((tokens[index] = shell_strdup(temp)) == NULL) {
+                print_error("Could not allocate memory", 1);
+                (void) free(temp);
+                (void) free(command_copy);
+                (void) free(tokens);
+                return NULL;
+            }
+            index++;
+            token_count++;
+        }
+
+        token = strtok_r(NULL, " \t", &last);
+        (void) free(temp);
+    }
+
+    tokens[index] = NULL;
+    *token_count_out = token_count;
+
+    (void) free(command_copy);
+
+    return tokens;
+}
+
+/**
+ * is_descriptor_duplication tells whether word starts with a
+ * descriptor number followed by >& or <&, as in 2>&1.
+ **/
+int
+is_descriptor_duplication(char *word) {
+    int index;
+
+    for (index = 0; word[index] >= '0' && word[index] <= '9'; index++) {
+        continue;
+    }
+
+    return index > 0 && (word[index] == '>' || word[index] == '<') && word[index + 1] == '&';
+}
+
+int
+print_command(char **tokens, int token_count) {
+    char *command_print;
+    int index, total_output_length;
+
+    total_output_length = token_count + 1;
+
+    if ((command_print = malloc(total_output_length)) == NULL) {
+        print_error("cd: Could not allocate memory", 0);
+        return 127;
+    }
+
+    command_print[0] = '\0';
+
+    for (index = 0; index < token_count; index++) {
+        if (index > 0) {
+            if (strcat(command_print, " ") == NULL) {
+                print_error("cd: Internal error: ", 0);
+            }
+        }
+
+        if (strcat(command_print, tokens[index]) == NULL) {
+            print_error("cd: Internal error: ", 0);
+        }
+    }
+
+    fprintf(stderr, "+ %s\n", command_print);
+
+    (void) free(command_print);
+
+    return 0;   
+}
+
+/**
+ * get_char_count gets the number of characters
+ * present in the input that are seperated by the
+ * space delimiter.
+ **/
+int
+get_char_count(char *command, char *delimiter) {
+    char *last, *token, *command_copy;
+    int token_count;
+
+    token_count = 0;
+
+    /* String duplication is required as strtok modifies the orignal string */
+    if ((command_copy = shell_strdup(command)) == NULL) {
+        return -1;
+    }
+
+    token = strtok_r(command_copy, delimiter, &last);
+
+    while (token != NULL) {
+        token_count++;
+        token = strtok_r(NULL, delimiter, &last);
+    }
+
+    (void) free(command_copy);
+    return token_count;
+}
+
+/**
+ * Changes the directory based on the input. This will return the status based on
+ * success of failure which can be used for '$' inputs in echo command. If null is
+ * passed then the home directory is fetched of the user and then chdir into the 
+ * home directory.
+ **/
+int
+perform_directory_change(char *directory) {
+    uid_t current_user;
+    struct passwd *user_info;
+
+    if (directory == NULL) {
+        current_user = geteuid();
+        if ((user_info = getpwuid(current_user)) == NULL) {
+            print_error("Could not determine home directory", 1);
+            return 127;
+        }
+
+        if ((directory = strdup(user_info->pw_dir)) == NULL) {
+            print_error("Could not allocate memory", 1);
+            return 127;
+        }
+    }
+
+    if (chdir(directory) < 0) {
+        print_error("cd: Could not change directory", 0);
+        return errno;
+    }    
+
+    return 0;
+}
+
+/**
+ * replace_dollars_in_tokens will iterate over the tokens and
+ * expand the parameters they contain: $$ and $? are replaced by
+ * the pid and previous return code respectively, and $NAME,
+ * ${NAME}, ${NAME[index]}, ${NAME[@]} and ${#NAME[@]} by the
+ * value of the shell variable or, failing that, the environment.
+ * A word that is nothing but ${NAME[@]} of an array becomes one word
+ * per element, so the tokens array may grow.
+ **/
+int
+replace_dollars_in_tokens(char ***tokens, int *token_count) {
+    struct variable *array;
+    int index;
+    char *expanded;
+
+    for (index = 0; index < *token_count; index++) {
+        if (strchr((*tokens)[index], '$') == NULL) {
+            continue;
+        }
+
+        if ((array = find_array_word((*tokens)[index])) != NULL) {
+            if (splice_array_elements(tokens, token_count, index, array) != 0) {
+                print_error("Could not allocate memory", 1);
+                return 127;
+            }
+            index += array->count - 1;
+            continue;
+        }
+
+        if ((expanded = expand_parameters((*tokens)[index])) == NULL) {
+            print_error("Could not allocate memory", 1);
+            return 127;
+        }
+
+        (void) free((*tokens)[index]);
+        (*tokens)[index] = expanded;
+    }
+
+    return 0;
+}
+
+/**
+ * find_array_word returns the shell variable if token is exactly
+ * ${NAME[@]}, or NULL.
+ **/
+struct variable *
+find_array_word(char *token) {
+    char name[256];
+    int length;
+
+    length = strlen(token);
+
+    if (length < 7 || strncmp(token, "${", 2) != 0 ||
+        strcmp(token + length - 4, "[@]}") != 0 || length - 6 >= (int) sizeof(name)) {
+        return NULL;
+    }
+
+    (void) memcpy(name, token + 2, length - 6);
+    name[length - 6] = '\0';
+
+    if (!is_variable_name(name)) {
+        return NULL;
+    }
+
+    return find_variable(name);
+}
+
+/**
+ * splice_array_elements replaces the token at position with a copy of
+ * every element of array.
+ **/
+int
+splice_array_elements(char ***tokens, int *token_count, int position, struct variable *array) {
+    char **grown, *word;
+    int index;
+
+    word = (*tokens)[position];
+
+    if ((grown = shell_realloc(*tokens, (*token_count + array->count) * sizeof(char *))) == NULL) {
+        return 1;
+    }
+    *tokens = grown;
+
+    /* Move the following tokens and the terminating NULL along */
+    (void) memmove(grown + position + array->count, grown + position + 1,
+                   (*token_count - position) * sizeof(char *));
+
+    for (index = 0; index < array->count; index++) {
+        if ((grown[position + index] = shell_strdup(array->values[index])) == NULL) {
+            /* Put the word and the following tokens back */
+            while (index-- > 0) {
+                (void) free(grown[position + index]);
+            }
+            (void) memmove(grown + position + 1, grown + position + array->count,
+                           (*token_count - position) * sizeof(char *));
+            grown[position] = word;
+            return 1;
+        }
+    }
+
+    *token_count += array->count - 1;
+    (void) free(word);
+
+    return 0;
+}
+
+/**
+ * expand_parameters returns a newly allocated copy of token with
+ * every parameter expanded. A $ that does not start a parameter is
+ * kept as it is.
+ **/
+char *
+expand_parameters(char *token) {
+    char *buffer, *end, number[32];
+    int length, capacity, index, name_end;
+
+    buffer = NULL;
+    length = 0;
+    capacity = 0;
+    index = 0;
+
+    if (append_to_buffer(&buffer, &length, &capacity, "", 0) != 0) {
+        return NULL;
+    }
+
+    while (token[index] != '\0') {
+        if (token[index] != '$') {
+            for (name_end = index; token[name_end] != '\0' && token[name_end] != '$'; name_end++) {
+                continue;
+            }
+            if (append_to_buffer(&buffer, &length, &capacity, token + index, name_end - index) != 0) {
+                return NULL;
+            }
+            index = name_end;
+            continue;
+        }
+
+        if (token[index + 1] == '$' || token[index + 1] == '?') {
+            (void) sprintf(number, "%i", token[index + 1] == '$' ? (int) getpid() : previous_exit_code);
+            if (append_to_buffer(&buffer, &length, &capacity, number, strlen(number)) != 0) {
+                return NULL;
+            }
+            index += 2;
+        } else if (token[index + 1] == '{' && (end = strchr(token + index + 2, '}')) != NULL) {
+            if (expand_named_parameter(token + index + 2, end - (token + index + 2),
+                                       &buffer, &length, &capacity) != 0) {
+                return NULL;
+            }
+            index = end - token + 1;
+        } else if (is_name_character(token[index + 1], 1)) {
+            for (name_end = index + 1; is_name_character(token[name_end], 0); name_end++) {
+                continue;
+            }
+            if (expand_named_parameter(token + index + 1, name_end - index - 1,
+                                       &buffer, &length, &capacity) != 0) {
+                return NULL;
+            }
+            index = name_end;
+        } else {
+            if (append_to_buffer(&buffer, &length, &capacity, "$", 1) != 0) {
+                return NULL;
+            }
+            index++;
+        }
+    }
+
+    return buffer;
+}
+
+/**
+ * expand_named_parameter appends the value of the parameter written as
+ * NAME, #NAME, NAME[subscript] or #NAME[subscript] to the buffer. The
+ * subscripts @ and * select every element, joined by spaces.
+ **/
+int
+expand_named_parameter(char *parameter, int parameter_length, char **buffer,
+                       int *length, int *capacity) {
+    struct variable *variable;
+    char name[256], number[32], *value;
+    int count_form, name_length, index, all_elements, element;
+
+    count_form = 0;
+    all_elements = 0;
+    element = 0;
+
+    if (parameter_length > 0 && parameter[0] == '#') {
+        count_form = 1;
+        parameter++;
+        parameter_length--;
+    }
+
+    for (name_length = 0; name_length < parameter_length &&
+         is_name_character(parameter[name_length], name_length == 0); name_length++) {
+        continue;
+    }
+
+    if (name_length == 0 || name_length >= (int) sizeof(name)) {
+        return 0;
+    }
+
+    (void) memcpy(name, parameter, name_length);
+    name[name_length] = '\0';
+
+    if (name_length < parameter_length && parameter[name_length] == '[') {
+        if (parameter[name_length + 1] == '@' || parameter[name_length + 1] == '*') {
+            all_elements = 1;
+        } else {
+            element = strtol(parameter + name_length + 1, NULL, 10);
+        }
+    }
+
+    if ((variable = find_variable(name)) == NULL) {
+        if (all_elements || element != 0 || (value = getenv(name)) == NULL) {
+            value = "";
+        }
+
+        if (count_form) {
+            (void) sprintf(number, "%i", all_elements ? (value[0] != '\0') : (int) strlen(value));
+            return append_to_buffer(buffer, length, capacity, number, strlen(number));
+        }
+
+        return append_to_buffer(buffer, length, capacity, value, strlen(value));
+    }
+
+    if (element < 0) {
+        element += variable->count;
+    }
+
+    if (count_form) {
+        if (all_elements) {
+            (void) sprintf(number, "%i", variable->count);
+        } else {
+            (void) sprintf(number, "%i", (element >= 0 && element < variable->count) ?
+                                         (int) strlen(variable->values[element]) : 0);
+        }
+        return append_to_buffer(buffer, length, capacity, number, strlen(number));
+    }
+
+    if (all_elements) {
+        for (index = 0; index < variable->count; index++) {
+            if ((index > 0 && append_to_buffer(buffer, length, capacity, " ", 1) != 0) ||
+                append_to_buffer(buffer, length, capacity, variable->values[index],
+                                 strlen(variable->values[index])) != 0) {
+                return 1;
+            }
+        }
+        return 0;
+    }
+
+    if (element < 0 || element >= variable->count) {
+        return 0;
+    }
+
+    return append_to_buffer(buffer, length, capacity, variable->values[element],
+                            strlen(variable->values[element]));
+}
+
+int
+is_name_character(char character, int first) {
+    if (character == '_' || (character >= 'a' && character <= 'z') ||
+        (character >= 'A' && character <= 'Z')) {
+        return 1;
+    }
+
+    return !first && character >= '0' && character <= '9';
+}
+
+/**
+ * append_to_buffer appends text_length bytes of text to a growable,
+ * null terminated buffer. If it cannot grow, the buffer is freed and
+ * left empty.
+ **/
+int
+append_to_buffer(char **buffer, int *length, int *capacity, char *text, int text_length) {
+    char *grown;
+
+    if (*length + text_length + 1 > *capacity) {
+        if ((grown = shell_realloc(*buffer, (*length + text_length + 1) * 2)) == NULL) {
+            (void) free(*buffer);
+            *buffer = NULL;
+            *length = 0;
+            *capacity = 0;
+            return 1;
+        }
+        *buffer = grown;
+        *capacity = (*length + text_length + 1) * 2;
+    }
+
+    (void) memcpy(*buffer + *length, text, text_length);
+    *length += text_length;
+    (*buffer)[*length] = '\0';
+
+    return 0;
+}
+
+/**
+ * find_variable returns the shell variable called name, or NULL when
+ * it has not been set.
+ **/
+struct variable *
+find_variable(char *name) {
+    int index;
+
+    for (index = 0; index < variable_count; index++) {
+        if (strcmp(variables[index].name, name) == 0) {
+            return &variables[index];
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * set_variable sets the shell variable called name to a copy of the
+ * count values given, replacing any previous value. A scalar is simply
+ * a variable with a single value.
+ **/
+int
+set_variable(char *name, char **values, int count) {
+    char **copies;
+    int index;
+
+    if ((copies = malloc((count + 1) * sizeof(char *))) == NULL) {
+        return 1;
+    }
+
+    for (index = 0; index < count; index++) {
+        if ((copies[index] = strdup(values[index])) == NULL) {
+            (void) free_arguments(copies);
+            return 1;
+        }
+    }
+
+    copies[count] = NULL;
+
+    if (store_variable(name, copies, count) != 0) {
+        (void) free_arguments(copies);
+        return 1;
+    }
+
+    return 0;
+}
+
+/**
+ * store_variable makes values, a NULL terminated array of allocated
+ * strings that the variable takes over, the value of name.
+ **/
+int
+store_variable(char *name, char **values, int count) {
+    struct variable *variable, *grown;
+    int index;
+
+    if ((variable = find_variable(name)) == NULL) {
+        if ((grown = realloc(variables, (variable_count + 1) * sizeof(struct variable))) == NULL) {
+            return 1;
+        }
+
+        variables = grown;
+        variable = &variables[variable_count++];
+
+        if ((variable->name = strdup(name)) == NULL) {
+            variable_count--;
+            return 1;
+        }
+    } else {
+        for (index = 0; index < variable->count; index++) {
+            (void) free(variable->values[index]);
+        }
+        (void) free(variable->values);
+    }
+
+    variable->values = values;
+    variable->count = count;
+
+    return 0;
+}
+
+/**
+ * set_status_variable stores a list of exit codes, such as the status
+ * of every stage of a pipeline, in the array variable called name.
+ **/
+int
+set_status_variable(char *name, int *statuses, int count) {
+    char **values, *numbers;
+    int index, result;
+
+    if ((values = malloc(count * sizeof(char *))) == NULL ||
+        (numbers = malloc(count * 12)) == NULL) {
+        return 1;
+    }
+
+    for (index = 0; index < count; index++) {
+        values[index] = numbers + index * 12;
+        (void) sprintf(values[index], "%i", statuses[index]);
+    }
+
+    result = set_variable(name, values, count);
+
+    (void) free(numbers);
+    (void) free(values);
+
+    return result;
+}
+
+/**
+ * echo like feature is performed on the tokens [1..n-1]
+ **/
+int
+perform_echo(char **tokens, int token_count, int command_length) {
+    char *echo_string;
+    int index, total_output_length;
+
+    total_output_length = command_length;
+
+    if ((echo_string = malloc(total_output_length + 1)) == NULL) {
+        print_error("cd: Could not allocate memory", 0);
+        return 127;
+    }
+
+    echo_string[0] = '\0';
+
+    for (index = 1; index < token_count; index++) {
+        if (index > 0) {
+            if (strcat(echo_string, " ") == NULL) {
+                print_error("cd: Internal error: ", 0);
+            }
+        }
+
+        if (strcat(echo_string, tokens[index]) == NULL) {
+            print_error("cd: Internal error: ", 0);
+        }
+    }
+
+    fprintf(stdout, "%s\n", echo_string);
+
+    (void) free(echo_string);
+
+    return 0;   
+}
+
+/**
+ * perform_exec executes the command which should be at the 0
+ * position of the tokens array. It passes tokens as the args as 
+ * it is. When execute_in_place is set the shell has nothing left
+ * to do afterwards, so the command replaces the shell directly
+ * instead of being forked and waited for. With the argbatch option
+ * an argument list too long for exec is run in batches instead.
+ **/
+int
+perform_exec(char **tokens) {
+    size_t size;
+    int index, status;
+    pid_t child_pid;
+
+    if (input_flags.arg_batch) {
+        size = 0;
+        for (index = 0; tokens[index] != NULL; index++) {
+            size += argument_size(tokens[index]);
+        }
+
+        if (size > argument_space()) {
+            return batch_oversized_command(tokens);
+        }
+    }
+
+    shell_statistics.execs++;
+
+    if (execute_in_place) {
+        if (getpid() == statistics_pid) {
+            (void) dump_shell_statistics();
+        }
+
+        return exec_command(tokens);
+    }
+  
+    if ((child_pid = fork_child()) < 0) {
+        print_error("Could not create new process: ", 1);
+        return 127;
+    } else if (child_pid == 0) {
+        exit(exec_command(tokens));
+    }
+
+    (void) wait_for_child(child_pid, &status);
+
+    if (WIFEXITED(status)) {
+        status = WEXITSTATUS(status);
+    }
+
+    return status;
+}
+
+/**
+ * exec_command replaces the current process with the command in
+ * tokens. It only returns, with 127, when the exec failed.
+ **/
+int
+exec_command(char **tokens) {
+    (void) close_stray_descriptors();
+    execvp(tokens[0], tokens);
+
+    if (errno == ENOENT) {
+        fprintf(stderr, "%s: command not found\n", tokens[0]);
+    } else {
+        fprintf(stderr, "%s: %s\n", tokens[0], strerror(errno));
+    }
+
+    return 127;
+}
+
+/**
+ * argument_size is the room argument takes up in the exec'd
+ * program's argument list: the string and its pointer.
+ **/
+size_t
+argument_size(char *argument) {
+    return strlen(argument) + 1 + sizeof(char *);
+}
+
+/**
+ * argument_space is how much room exec leaves for the argument list
+ * once the environment, which shares the same limit, is accounted for.
+ **/
+size_t
+argument_space() {
+    extern char **environ;
+    size_t space, environment;
+    long limit;
+    int index;
+
+    if ((limit = sysconf(_SC_ARG_MAX)) <= 0) {
+        limit = ARG_MAX;
+    }
+
+    environment = ARG_HEADROOM;
+    for (index = 0; environ[index] != NULL; index++) {
+        environment += argument_size(environ[index]);
+    }
+
+    space = (size_t) limit;
+
+    return space > environment ? space - environment : 0;
+}
+
+/**
+ * batch_oversized_command runs a command whose argument list does not
+ * fit into one exec. The command name and its leading options, up to
+ * and including "--", are repeated for every batch while the remaining
+ * operands are spread over as few batches as possible.
+ **/
+int
+batch_oversized_command(char **tokens) {
+    struct batch_limits limits;
+    int prefix_count, token_count;
+
+    for (token_count = 0; tokens[token_count] != NULL; token_count++) {
+        continue;
+    }
+
+    for (prefix_count = 1; prefix_count < token_count &&
+                           tokens[prefix_count][0] == '-' &&
+                           tokens[prefix_count][1] != '\0'; prefix_count++) {
+        if (strcmp(tokens[prefix_count], "--") == 0) {
+            prefix_count++;
+            break;
+        }
+    }
+
+    limits.jobs = 1;
+    limits.max_args = 0;
+    limits.max_bytes = argument_space();
+
+    return run_batches(tokens, prefix_count, tokens + prefix_count,
+                       token_count - prefix_count, &limits);
+}
+
+/**
+ * perform_batch implements "batch [-P jobs] [-n count] [-s size]
+ * command [argument ...]". Like xargs it reads operands from standard
+ * input, one per line, and runs the command with the given arguments
+ * followed by as many operands as fit, up to jobs batches at a time.
+ **/
+int
+perform_batch(char **tokens, int token_count) {
+    struct batch_limits limits;
+    char *buffer, **operands;
+    int index, value, operand_count, status;
+
+    limits.jobs = 1;
+    limits.max_args = 0;
+    limits.max_bytes = argument_space();
+
+    for (index = 1; index + 1 < token_count; index += 2) {
+        if (strcmp(tokens[index], "-P") != 0 && strcmp(tokens[index], "-n") != 0 &&
+            strcmp(tokens[index], "-s") != 0) {
+            break;
+        }
+
+        if ((value = parse_positive_number(tokens[index + 1])) < 0) {
+            fprintf(stderr, "batch: %s: invalid number\n", tokens[index + 1]);
+            return 2;
+        }
+
+        if (tokens[index][1] == 'P') {
+            limits.jobs = value;
+        } else if (tokens[index][1] == 'n') {
+            limits.max_args = value;
+        } else if ((size_t) value < limits.max_bytes) {
+            limits.max_bytes = value;
+        }
+    }
+
+    if (index == token_count) {
+        fprintf(stderr, "batch: Usage: batch [-P jobs] [-n count] [-s size] command [argument ...]\n");
+        return 2;
+    }
+
+    if (read_batch_operands(&buffer, &operands, &operand_count) != 0) {
+        return 127;
+    }
+
+    status = run_batches(tokens + index, token_count - index, operands,
+                         operand_count, &limits);
+
+    (void) free(operands);
+    (void) free(buffer);
+
+    return status;
+}
+
+/**
+ * run_batches runs the prefix followed by successive slices of the
+ * operands, each slice as large as limits allows. Up to limits->jobs
+ * batches run at once and they are waited for in the order they were
+ * started, so the status returned is that of the first batch that
+ * failed, or 0.
+ **/
+int
+run_batches(char **prefix, int prefix_count, char **operands, int operand_count,
+            struct batch_limits *limits) {
+    char **arguments;
+    size_t prefix_size, size;
+    int index, next, count, running_count, oldest, status, result;
+    pid_t child, *running;
+
+    arguments = shell_malloc((prefix_count + operand_count + 1) * sizeof(char *));
+    running = shell_malloc(limits->jobs * sizeof(pid_t));
+
+    if (arguments == NULL || running == NULL) {
+        print_error("Could not allocate memory", 1);
+        (void) free(arguments);
+        (void) free(running);
+        return 127;
+    }
+
+    prefix_size = 0;
+    for (index = 0; index < prefix_count; index++) {
+        arguments[index] = prefix[index];
+        prefix_size += argument_size(prefix[index]);
+    }
+
+    result = 0;
+    next = 0;
+    oldest = 0;
+    running_count = 0;
+
+    while (next < operand_count) {
+        size = prefix_size;
+        for (count = 0; next + count < operand_count &&
+                        (limits->max_args == 0 || count < limits->max_args); count++) {
+            if (size + argument_size(operands[next + count]) > limits->max_bytes) {
+                break;
+            }
+            size += argument_size(operands[next + count]);
+            arguments[prefix_count + count] = operands[next + count];
+        }
+
+        if (count == 0) {
+            fprintf(stderr, "%s: Argument list too long\n", prefix[0]);
+            if (result == 0) {
+                result = 127;
+            }
+            break;
+        }
+
+        arguments[prefix_count + count] = NULL;
+        next += count;
+
+        if (running_count == limits->jobs) {
+            (void) wait_for_child(running[oldest], &status);
+            if (result == 0) {
+                result = get_exit_code(status);
+            }
+            oldest = (oldest + 1) % limits->jobs;
+            running_count--;
+        }
+
+        shell_statistics.execs++;
+
+        if ((child = fork_child()) < 0) {
+            print_error("Could not fork a child", 1);
+            if (result == 0) {
+                result = 127;
+            }
+            break;
+        } else if (child == 0) {
+            exit(exec_command(arguments));
+        }
+
+        running[(oldest + running_count) % limits->jobs] = child;
+        running_count++;
+    }
+
+    for (; running_count > 0; running_count--) {
+        (void) wait_for_child(running[oldest], &status);
+        if (result == 0) {
+            result = get_exit_code(status);
+        }
+        oldest = (oldest + 1) % limits->jobs;
+    }
+
+    (void) free(arguments);
+    (void) free(running);
+
+    return result;
+}
+
+/**
+ * read_batch_operands reads standard input to the end and splits it
+ * into lines, skipping empty ones. The operands point into buffer.
+ **/
+int
+read_batch_operands(char **buffer, char ***operands, int *count) {
+    size_t length, capacity, start, index;
+    ssize_t bytes;
+    char *grown;
+    int operand_count;
+
+    length = 0;
+    capacity = BATCH_READ_SIZE;
+
+    if ((*buffer = shell_malloc(capacity + 1)) == NULL) {
+        print_error("Could not allocate memory", 1);
+        return 1;
+    }
+
+    for (;;) {
+        if (length == capacity) {
+            capacity *= 2;
+            if ((grown = shell_realloc(*buffer, capacity + 1)) == NULL) {
+                print_error("Could not allocate memory", 1);
+                (void) free(*buffer);
+                return 1;
+            }
+            *buffer = grown;
+        }
+
+        if ((bytes = read(STDIN_FILENO, *buffer + length, capacity - length)) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            print_error("batch: Could not read standard input", 0);
+            (void) free(*buffer);
+            return 1;
+        } else if (bytes == 0) {
+            break;
+        }
+
+        length += bytes;
+    }
+
+    (*buffer)[length] = '\n';
+
+    operand_count = 0;
+    for (index = 0; index <= length; index++) {
+        if ((*buffer)[index] == '\n' && (index == 0 || (*buffer)[index - 1] != '\n')) {
+            operand_count++;
+        }
+    }
+
+    if ((*operands = shell_malloc((operand_count + 1) * sizeof(char *))) == NULL) {
+        print_error("Could not allocate memory", 1);
+        (void) free(*buffer);
+        return 1;
+    }
+
+    *count = 0;
+    start = 0;
+    for (index = 0; index <= length; index++) {
+        if ((*buffer)[index] != '\n') {
+            continue;
+        }
+
+        (*buffer)[index] = '\0';
+        if (index > start) {
+            (*operands)[(*count)++] = *buffer + start;
+        }
+        start = index + 1;
+    }
+
+    return 0;
+}
+
+/**
+ * perform_parallel implements "parallel [-j jobs] [-k] command
+ * [argument ...] [::: input ...]". The command is run once per input,
+ * read from stdin one per line when no ::: is given, with {} replaced
+ * by the input or the input appended when there is no {}. The input
+ * only ever becomes part of an argument, it is not parsed as shell
+ * syntax. Up to jobs of them run at once, each with its stdout and
+ * stderr collected and written out in one piece when it finishes, or
+ * in input order with -k. The status is the number of failed jobs, 101 for more than 100.
+ **/
+int
+perform_parallel(char **tokens, int token_count) {
+    struct parallel_job *jobs;
+    struct pollfd *poll_fds;
+    struct parallel_job **polled;
+    char *buffer, **inputs, **arguments;
+    int index, command_start, command_end, input_count, max_jobs, keep_order;
+    int next, running, printed, first_pending, poll_count, failed, argument_count;
+    long processors;
+
+    if ((processors = sysconf(_SC_NPROCESSORS_ONLN)) < 1) {
+        processors = 1;
+    }
+
+    max_jobs = (int) processors;
+    keep_order = 0;
+    buffer = NULL;
+
+    for (index = 1; index < token_count; index++) {
+        if (strcmp(tokens[index], "-k") == 0) {
+            keep_order = 1;
+        } else if (strcmp(tokens[index], "-j") == 0 && index + 1 < token_count) {
+            if ((max_jobs = parse_positive_number(tokens[++index])) < 0) {
+                fprintf(stderr, "parallel: %s: invalid number\n", tokens[index]);
+                return 255;
+            }
+        } else {
+            break;
+        }
+    }
+
+    command_start = index;
+    for (command_end = command_start; command_end < token_count &&
+                                      strcmp(tokens[command_end], ":::") != 0; command_end++) {
+        continue;
+    }
+
+    if (command_start == command_end) {
+        fprintf(stderr, "parallel: Usage: parallel [-j jobs] [-k] command [argument ...] "
+                        "[::: input ...]\n");
+        return 255;
+    }
+
+    if (command_end < token_count) {
+        inputs = tokens + command_end + 1;
+        input_count = token_count - command_end - 1;
+    } else if (read_batch_operands(&buffer, &inputs, &input_count) != 0) {
+        return 255;
+    }
+
+    jobs = calloc(input_count + 1, sizeof(struct parallel_job));
+    poll_fds = malloc(2 * max_jobs * sizeof(struct pollfd));
+    polled = malloc(2 * max_jobs * sizeof(struct parallel_job *));
+
+    if (jobs == NULL || poll_fds == NULL || polled == NULL) {
+        print_error("Could not allocate memory", 1);
+        (void) free(jobs);
+        (void) free(poll_fds);
+        (void) free(polled);
+        if (buffer != NULL) {
+            (void) free(inputs);
+            (void) free(buffer);
+        }
+        return 255;
+    }
+
+    next = 0;
+    running = 0;
+    printed = 0;
+    first_pending = 0;
+    failed = 0;
+
+    while (printed < input_count) {
+        for (; running < max_jobs && next < input_count; next++) {
+            if ((arguments = build_parallel_arguments(tokens + command_start,
+                                                      command_end - command_start,
+                                                      inputs[next], &argument_count)) == NULL ||
+                start_parallel_job(&jobs[next], arguments, argument_count) != 0) {
+                jobs[next].output_fd = -1;
+                jobs[next].error_fd = -1;
+                jobs[next].done = 1;
+                jobs[next].status = 127;
+                failed++;
+                printed += !keep_order;
+            } else {
+                running++;
+            }
+            (void) free_arguments(arguments);
+        }
+
+        while (first_pending < next && jobs[first_pending].done) {
+            first_pending++;
+        }
+
+        poll_count = 0;
+        for (index = first_pending; index < next; index++) {
+            if (jobs[index].output_fd >= 0) {
+                poll_fds[poll_count].fd = jobs[index].output_fd;
+                poll_fds[poll_count].events = POLLIN;
+                polled[poll_count++] = &jobs[index];
+            }
+            if (jobs[index].error_fd >= 0) {
+                poll_fds[poll_count].fd = jobs[index].error_fd;
+                poll_fds[poll_count].events = POLLIN;
+                polled[poll_count++] = &jobs[index];
+            }
+        }
+
+        if (poll_count > 0 && poll(poll_fds, poll_count, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            print_error("parallel: Could not wait for jobs", 0);
+            failed += running;
+            break;
+        }
+
+        for (index = 0; index < poll_count; index++) {
+            if (poll_fds[index].revents == 0 ||
+                collect_parallel_output(polled[index],
+                                        poll_fds[index].fd == polled[index]->error_fd) == 0 ||
+                polled[index]->output_fd >= 0 || polled[index]->error_fd >= 0) {
+                continue;
+            }
+
+            (void) wait_for_child(polled[index]->pid, &polled[index]->status);
+            polled[index]->status = get_exit_code(polled[index]->status);
+            polled[index]->done = 1;
+            failed += polled[index]->status != 0;
+            running--;
+
+            if (!keep_order) {
+                (void) flush_parallel_job(polled[index]);
+                printed++;
+            }
+        }
+
+        while (keep_order && printed < next && jobs[printed].done) {
+            (void) flush_parallel_job(&jobs[printed]);
+            printed++;
+        }
+    }
+
+    /* Only left after a failed poll: the jobs still running lose their
+       pipes, so they finish once they next write, and are reaped */
+    for (index = 0; index < next; index++) {
+        if (!jobs[index].done) {
+            if (jobs[index].output_fd >= 0) {
+                (void) close(jobs[index].output_fd);
+            }
+            if (jobs[index].error_fd >= 0) {
+                (void) close(jobs[index].error_fd);
+            }
+            (void) wait_for_child(jobs[index].pid, &jobs[index].status);
+        }
+        (void) free(jobs[index].output);
+        (void) free(jobs[index].error);
+    }
+
+    (void) free(jobs);
+    (void) free(poll_fds);
+    (void) free(polled);
+    if (buffer != NULL) {
+        (void) free(inputs);
+        (void) free(buffer);
+    }
+
+    return failed > 100 ? 101 : failed;
+}
+
+/**
+ * build_parallel_arguments copies the command tokens into a new
+ * argument list with every {} replaced by input, or with input added
+ * as a last argument if there is no {}.
+ **/
+char **
+build_parallel_arguments(char **tokens, int token_count, char *input, int *argument_count) {
+    char **arguments, *token, *placeholder, *argument;
+    int index, length, capacity, substituted, failed;
+
+    if ((arguments = calloc(token_count + 2, sizeof(char *))) == NULL) {
+        print_error("Could not allocate memory", 1);
+        return NULL;
+    }
+
+    substituted = 0;
+
+    for (index = 0; index < token_count; index++) {
+        argument = NULL;
+        length = 0;
+        capacity = 0;
+        failed = 0;
+
+        for (token = tokens[index]; !failed && (placeholder = strstr(token, "{}")) != NULL;
+             token = placeholder + 2) {
+            failed = append_to_buffer(&argument, &length, &capacity, token, placeholder - token) != 0 ||
+                     append_to_buffer(&argument, &length, &capacity, input, strlen(input)) != 0;
+            substituted = 1;
+        }
+
+        if (failed || append_to_buffer(&argument, &length, &capacity, token, strlen(token)) != 0) {
+            print_error("Could not allocate memory", 1);
+            (void) free(argument);
+            (void) free_arguments(arguments);
+            return NULL;
+        }
+
+        arguments[index] = argument;
+    }
+
+    if (!substituted && (arguments[index++] = strdup(input)) == NULL) {
+        print_error("Could not allocate memory", 1);
+        (void) free_arguments(arguments);
+        return NULL;
+    }
+
+    *argument_count = index;
+
+    return arguments;
+}
+
+/**
+ * free_arguments releases a NULL terminated argument list and the
+ * strings in it.
+ **/
+void
+free_arguments(char **arguments) {
+    int index;
+
+    if (arguments == NULL) {
+        return;
+    }
+
+    for (index = 0; arguments[index] != NULL; index++) {
+        (void) free(arguments[index]);
+    }
+    (void) free(arguments);
+}
+
+/**
+ * start_parallel_job forks a child that runs the command in arguments
+ * with its stdout and stderr going to pipes the shell collects them
+ * from.
+ **/
+int
+start_parallel_job(struct parallel_job *job, char **arguments, int argument_count) {
+    int output_pipe[2], error_pipe[2];
+
+    if (pipe2(output_pipe, O_CLOEXEC)) {
+        print_error("Could not create a pipe", 1);
+        return 1;
+    }
+
+    if (pipe2(error_pipe, O_CLOEXEC)) {
+        print_error("Could not create a pipe", 1);
+        (void) close(output_pipe[0]);
+        (void) close(output_pipe[1]);
+        return 1;
+    }
+
+    if ((job->pid = fork_child()) < 0) {
+        print_error("Could not fork a child", 1);
+        (void) close(output_pipe[0]);
+        (void) close(output_pipe[1]);
+        (void) close(error_pipe[0]);
+        (void) close(error_pipe[1]);
+        job->pid = 0;
+        return 1;
+    } else if (job->pid == 0) {
+        if (dup2(output_pipe[1], STDOUT_FILENO) != STDOUT_FILENO ||
+            dup2(error_pipe[1], STDERR_FILENO) != STDERR_FILENO) {
+            fprintf(stderr, "Could not duplicate fd: %s \n", strerror(errno));
+            exit(127);
+        }
+
+        (void) adopt_standard_descriptors();
+
+        execute_in_place = 1;
+        exit(run_simple_command(arguments, argument_count));
+    }
+
+    (void) close(output_pipe[1]);
+    (void) close(error_pipe[1]);
+    job->output_fd = output_pipe[0];
+    job->error_fd = error_pipe[0];
+
+    return 0;
+}
+
+/**
+ * collect_parallel_output reads what is available from the job's
+ * stdout or stderr pipe into its buffer. It returns 1 once the pipe
+ * reached end of file and has been closed.
+ **/
+int
+collect_parallel_output(struct parallel_job *job, int error_stream) {
+    char data[BATCH_READ_SIZE];
+    ssize_t bytes;
+    int *fd, status;
+
+    fd = error_stream ? &job->error_fd : &job->output_fd;
+
+    if ((bytes = read(*fd, data, sizeof(data))) < 0 && errno == EINTR) {
+        return 0;
+    }
+
+    if (bytes > 0) {
+        if (error_stream) {
+            status = append_to_buffer(&job->error, &job->error_length,
+                                      &job->error_capacity, data, bytes);
+        } else {
+            status = append_to_buffer(&job->output, &job->output_length,
+                                      &job->output_capacity, data, bytes);
+        }
+
+        if (status == 0) {
+            return 0;
+        }
+        print_error("Could not allocate memory", 1);
+    }
+
+    (void) close(*fd);
+    *fd = -1;
+
+    return 1;
+}
+
+/**
+ * flush_parallel_job writes the job's collected stdout and stderr and
+ * releases them.
+ **/
+void
+flush_parallel_job(struct parallel_job *job) {
+    if (job->output_length > 0) {
+        (void) write_exact(STDOUT_FILENO, job->output, job->output_length);
+    }
+
+    if (job->error_length > 0) {
+        (void) write_exact(STDERR_FILENO, job->error, job->error_length);
+    }
+
+    (void) free(job->output);
+    (void) free(job->error);
+    job->output = NULL;
+    job->error = NULL;
+}
+
+/**
+ * parse_positive_number parses a decimal count, returning -1 unless
+ * the whole string is a number greater than zero.
+ **/
+int
+parse_positive_number(char *number) {
+    char *end;
+    long value;
+
+    errno = 0;
+    value = strtol(number, &end, 10);
+
+    if (errno != 0 || end == number || *end != '\0' || value <= 0 || value > INT_MAX) {
+        return -1;
+    }
+
+    return (int) value;
+}
+
+/**
+ * fork_child forks and counts the fork in the shell statistics.
+ **/
+pid_t
+fork_child() {
+    shell_statistics.forks++;
+
+    return fork();
+}
+
+/**
+ * wait_for_child waits for the child to exit, counting the time spent
+ * as time the shell was blocked on its children.
+ **/
+pid_t
+wait_for_child(pid_t child, int *status) {
+    double start;
+    pid_t result;
+
+    start = monotonic_seconds();
+
+    while ((result = waitpid(child, status, 0)) < 0 && errno == EINTR) {
+        continue;
+    }
+
+    shell_statistics.wait_seconds += monotonic_seconds() - start;
+
+    return result;
+}
+
+/**
+ * shell_malloc, shell_realloc and shell_strdup are used on the command
+ * execution hot paths so that the memory they allocate shows up in the
+ * shell statistics.
+ **/
+void *
+shell_malloc(size_t size) {
+    shell_statistics.allocations++;
+    shell_statistics.bytes_allocated += size;
+
+    return malloc(size);
+}
+
+void *
+shell_realloc(void *pointer, size_t size) {
+    shell_statistics.allocations++;
+    shell_statistics.bytes_allocated += size;
+
+    return realloc(pointer, size);
+}
+
+char *
+shell_strdup(char *string) {
+    shell_statistics.allocations++;
+    shell_statistics.bytes_allocated += strlen(string) + 1;
+
+    return strdup(string);
+}
+
+/**
+ * perform_shstats prints the shell's own counters, or with -r resets
+ * them.
+ **/
+int
+perform_shstats(char **tokens, int token_count) {
+    if (token_count > 1) {
+        if (strcmp(tokens[1], "-r") != 0) {
+            fprintf(stderr, "shstats: Usage: shstats [-r]\n");
+            return 2;
+        }
+
+        (void) memset(&shell_statistics, 0, sizeof(shell_statistics));
+        return 0;
+    }
+
+    (void) print_shell_statistics(stdout);
+
+    return 0;
+}
+
+void
+print_shell_statistics(FILE *output) {
+    struct rusage usage;
+
+    if (getrusage(RUSAGE_SELF, &usage) < 0) {
+        usage.ru_maxrss = 0;
+    }
+
+    fprintf(output, "commands\t%lu\n", shell_statistics.commands);
+    fprintf(output, "builtins\t%lu\n", shell_statistics.builtins);
+    fprintf(output, "forks\t\t%lu\n", shell_statistics.forks);
+    fprintf(output, "execs\t\t%lu\n", shell_statistics.execs);
+    fprintf(output, "allocations\t%lu\n", shell_statistics.allocations);
+    fprintf(output, "bytes_allocated\t%lu\n", shell_statistics.bytes_allocated);
+    fprintf(output, "peak_rss_kb\t%ld\n", (long) usage.ru_maxrss);
+    fprintf(output, "lex_seconds\t%.6f\n", shell_statistics.lex_seconds);
+    fprintf(output, "expand_seconds\t%.6f\n", shell_statistics.expand_seconds);
+    fprintf(output, "redirect_seconds\t%.6f\n", shell_statistics.redirect_seconds);
+    fprintf(output, "wait_seconds\t%.6f\n", shell_statistics.wait_seconds);
+}
+
+/**
+ * dump_shell_statistics is registered with atexit when SISH_STATS is
+ * set. Children forked by the shell inherit the registration, so only
+ * the shell process itself reports.
+ **/
+void
+dump_shell_statistics() {
+    if (getpid() != statistics_pid) {
+        return;
+    }
+
+    fprintf(stderr, "%s: statistics\n", getprogname());
+    (void) print_shell_statistics(stderr);
+}
+
+/**
+ * is_builtin tells whether name is run by the shell itself.
+ **/
+int
+is_builtin(char *name) {
+    return strcmp(name, "cd") == 0 || strcmp(name, "echo") == 0 ||
+           strcmp(name, "set") == 0 || strcmp(name, "shstats") == 0 ||
+           strcmp(name, "sched") == 0 || strcmp(name, "timeout") == 0 ||
+           strcmp(name, "ulimit") == 0 || strcmp(name, "batch") == 0 ||
+           strcmp(name, "parallel") == 0 || strcmp(name, "history") == 0 ||
+           strcmp(name, "source") == 0 || strcmp(name, ".") == 0 ||
+           strcmp(name, "coproc") == 0 || strcmp(name, "read") == 0 ||
+           strcmp(name, "mapfile") == 0 || strcmp(name, "readarray") == 0;
+}
+
+/**
+ * perform_timeout implements "timeout duration [-s signal] command",
+ * where command may also be a group such as ( a | b ) to time a whole
+ * pipeline. The command runs in a child that leads its own process
+ * group, so everything started by it can be signalled as a whole. The
+ * shell waits for SIGCHLD with sigtimedwait and, once the duration
+ * has passed, sends the signal to the group and returns 124.
+ **/
+int
+perform_timeout(char **tokens, int token_count) {
+    struct timespec deadline, now, remaining;
+    sigset_t child_mask, saved_mask;
+    double duration;
+    int index, signal_number, status, timed_out;
+    pid_t child;
+
+    signal_number = SIGTERM;
+    duration = -1;
+    timed_out = 0;
+
+    for (index = 1; index < token_count; index++) {
+        if (strcmp(tokens[index], "-s") == 0 && (token_count - index) > 1) {
+            if ((signal_number = parse_signal(tokens[++index])) < 0) {
+                fprintf(stderr, "timeout: %s: invalid signal\n", tokens[index]);
+                return 125;
+            }
+        } else if (duration < 0) {
+            if ((duration = parse_duration(tokens[index])) < 0) {
+                fprintf(stderr, "timeout: %s: invalid time interval\n", tokens[index]);
+                return 125;
+            }
+        } else {
+            break;
+        }
+    }
+
+    /* Exactly one of a simple command and a group */
+    if (duration < 0 || (index == token_count) == (prefixed_group == NULL)) {
+        fprintf(stderr, "timeout: Usage: timeout duration [-s signal] command\n");
+        return 125;
+    }
+
+    (void) sigemptyset(&child_mask);
+    (void) sigaddset(&child_mask, SIGCHLD);
+
+    if (sigprocmask(SIG_BLOCK, &child_mask, &saved_mask) < 0) {
+        print_error("timeout: Could not block signal", 0);
+        return 125;
+    }
+
+    (void) clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += (time_t) duration;
+    deadline.tv_nsec += (long) ((duration - (time_t) duration) * 1000000000);
+    if (deadline.tv_nsec >= 1000000000) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000;
+    }
+
+    if ((child = fork_child()) < 0) {
+        print_error("Could not fork a child", 1);
+        (void) sigprocmask(SIG_SETMASK, &saved_mask, NULL);
+        return 125;
+    } else if (child == 0) {
+        (void) setpgid(0, 0);
+        (void) sigprocmask(SIG_SETMASK, &saved_mask, NULL);
+
+        execute_in_place = 1;
+        if (index == token_count) {
+            (void) run_prefixed_group();
+            exit(previous_exit_code);
+        }
+        exit(run_simple_command(tokens + index, token_count - index));
+    }
+
+    /* Set the group from both sides so the kill below cannot race it */
+    (void) setpgid(child, child);
+
+    while (waitpid(child, &status, WNOHANG) == 0) {
+        if (duration == 0) {
+            (void) wait_for_child(child, &status);
+            break;
+        }
+
+        (void) clock_gettime(CLOCK_MONOTONIC, &now);
+        remaining.tv_sec = deadline.tv_sec - now.tv_sec;
+        remaining.tv_nsec = deadline.tv_nsec - now.tv_nsec;
+        if (remaining.tv_nsec < 0) {
+            remaining.tv_sec--;
+            remaining.tv_nsec += 1000000000;
+        }
+
+        if (remaining.tv_sec < 0) {
+            (void) kill(-child, signal_number);
+            (void) wait_for_child(child, &status);
+            timed_out = 1;
+            break;
+        }
+
+        /* Any SIGCHLD wakes us up, the loop condition checks it was ours */
+        (void) sigtimedwait(&child_mask, NULL, &remaining);
+        shell_statistics.wait_seconds += monotonic_seconds() - now.tv_sec - now.tv_nsec / 1e9;
+    }
+
+    (void) sigprocmask(SIG_SETMASK, &saved_mask, NULL);
+
+    if (timed_out) {
+        return 124;
+    }
+
+    return get_exit_code(status);
+}
+
+/**
+ * run_prefixed_command runs the command that follows a prefix builtin
+ * such as sched or ulimit, or the group in prefixed_group when no words
+ * are left. setup is called in the process that goes on to run the
+ * command, so whatever it changes only affects that command. That is a
+ * forked child, or the shell itself when it is about to be replaced
+ * anyway.
+ **/
+int
+run_prefixed_command(char **tokens, int token_count, int (*setup)(void *), void *argument) {
+    int status;
+    pid_t child;
+
+    if (execute_in_place) {
+        if (setup(argument) != 0) {
+            return 1;
+        }
+
+        return run_prefixed_words(tokens, token_count);
+    }
+
+    if ((child = fork_child()) < 0) {
+        print_error("Could not fork a child", 1);
+        return 127;
+    } else if (child == 0) {
+        if (setup(argument) != 0) {
+            exit(1);
+        }
+
+        execute_in_place = 1;
+        exit(run_prefixed_words(tokens, token_count));
+    }
+
+    (void) wait_for_child(child, &status);
+
+    return get_exit_code(status);
+}
+
+/**
+ * run_prefixed_words runs the words of a prefixed command as they are,
+ * since they have already been expanded, or the prefixed group.
+ **/
+int
+run_prefixed_words(char **tokens, int token_count) {
+    if (token_count == 0) {
+        (void) run_prefixed_group();
+        return previous_exit_code;
+    }
+
+    return run_simple_command(tokens, token_count);
+}
+
+/**
+ * perform_ulimit implements "ulimit [-H] [-S] [-a] [-flag [value]]...
+ * [command]". A flag without a value prints the limit. Limits given
+ * values are set on the shell itself or, when a command or a group such
+ * as ( a | b ) follows, only on that command. The command's words are
+ * run as they are, without being parsed again. Setting changes both the
+ * soft and hard limit unless -S or -H is given.
+ **/
+int
+perform_ulimit(char **tokens, int token_count) {
+    struct resource_limits limits;
+    struct limit_option *option;
+    int index, character, print_all, printed, status;
+
+    (void) memset(&limits, 0, sizeof(limits));
+    print_all = 0;
+    printed = 0;
+
+    for (index = 1; index < token_count && tokens[index][0] == '-' &&
+                    tokens[index][1] != '\0'; index++) {
+        for (character = 1; tokens[index][character] != '\0'; character++) {
+            if (tokens[index][character] == 'H') {
+                limits.hard = 1;
+            } else if (tokens[index][character] == 'S') {
+                limits.soft = 1;
+            } else if (tokens[index][character] == 'a') {
+                print_all = 1;
+            } else if ((option = find_limit_option(tokens[index][character])) == NULL ||
+                       tokens[index][character + 1] != '\0') {
+                fprintf(stderr, "ulimit: Usage: ulimit [-HSa] [-cdfmnstuv [value]] [command]\n");
+                return 2;
+            } else if (index + 1 < token_count && is_limit_value(tokens[index + 1])) {
+                if (limits.count == MAX_LIMIT_SETTINGS) {
+                    fprintf(stderr, "ulimit: Too many limits\n");
+                    return 2;
+                }
+                limits.settings[limits.count].option = option;
+                if (parse_limit_value(tokens[++index], option,
+                                      &limits.settings[limits.count].value) != 0) {
+                    fprintf(stderr, "ulimit: %s: limit out of range\n", tokens[index]);
+                    return 2;
+                }
+                limits.count++;
+                break;
+            } else {
+                if ((status = print_limit(option, limits.hard, 0)) != 0) {
+                    return status;
+                }
+                printed = 1;
+            }
+        }
+    }
+
+    if (print_all) {
+        for (character = 0; LIMIT_FLAGS[character] != '\0'; character++) {
+            if ((status = print_limit(find_limit_option(LIMIT_FLAGS[character]),
+                                      limits.hard, 1)) != 0) {
+                return status;
+            }
+        }
+        printed = 1;
+    }
+
+    if (index < token_count && prefixed_group != NULL) {
+        fprintf(stderr, "ulimit: Usage: ulimit [-HSa] [-cdfmnstuv [value]] [command]\n");
+        return 2;
+    }
+
+    if (index < token_count || prefixed_group != NULL) {
+        return run_prefixed_command(tokens + index, token_count - index, apply_limits, &limits);
+    }
+
+    if (limits.count == 0 && !printed) {
+        return print_limit(find_limit_option('f'), limits.hard, 0);
+    }
+
+    return apply_limits(&limits);
+}
+
+/**
+ * find_limit_option returns the resource, unit and description used
+ * for one of the ulimit flags, or NULL for an unknown flag.
+ **/
+struct limit_option *
+find_limit_option(char flag) {
+    static struct limit_option options[] = {
+        { 'c', RLIMIT_CORE,   512,  "core file size", "blocks" },
+        { 'd', RLIMIT_DATA,   1024, "data seg size", "kbytes" },
+        { 'f', RLIMIT_FSIZE,  512,  "file size", "blocks" },
+        { 'm', RLIMIT_RSS,    1024, "max memory size", "kbytes" },
+        { 'n', RLIMIT_NOFILE, 1,    "open files", "files" },
+        { 's', RLIMIT_STACK,  1024, "stack size", "kbytes" },
+        { 't', RLIMIT_CPU,    1,    "cpu time", "seconds" },
+        { 'u', RLIMIT_NPROC,  1,    "max user processes", "processes" },
+        { 'v', RLIMIT_AS,     1024, "virtual memory", "kbytes" }
+    };
+    unsigned int index;
+
+    for (index = 0; index < sizeof(options) / sizeof(options[0]); index++) {
+        if (options[index].flag == flag) {
+            return &options[index];
+        }
+    }
+
+    return NULL;
+}
+
+int
+is_limit_value(char *value) {
+    if (strcmp(value, "unlimited") == 0) {
+        return 1;
+    }
+
+    for (; *value != '\0'; value++) {
+        if (*value < '0' || *value > '9') {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+/**
+ * parse_limit_value stores the value, given in the option's unit, in
+ * bytes or counts in limit. Returns 1 if it does not fit an rlim_t
+ * below RLIM_INFINITY.
+ **/
+int
+parse_limit_value(char *value, struct limit_option *option, rlim_t *limit) {
+    unsigned long number;
+
+    if (strcmp(value, "unlimited") == 0) {
+        *limit = RLIM_INFINITY;
+        return 0;
+    }
+
+    errno = 0;
+    number = strtoul(value, NULL, 10);
+
+    if ((number == ULONG_MAX && errno == ERANGE) ||
+        (rlim_t) number != number || (rlim_t) number > (RLIM_INFINITY - 1) / option->unit) {
+        return 1;
+    }
+
+    *limit = (rlim_t) number * option->unit;
+
+    return 0;
+}
+
+int
+print_limit(struct limit_option *option, int hard, int describe) {
+    struct rlimit limit;
+    rlim_t value;
+
+    if (getrlimit(option->resource, &limit) < 0) {
+        print_error("ulimit: Could not get limit", 0);
+        return 1;
+    }
+
+    value = hard ? limit.rlim_max : limit.rlim_cur;
+
+    if (describe) {
+        fprintf(stdout, "%-20s (%s, -%c) ", option->description, option->unit_name, option->flag);
+    }
+
+    if (value == RLIM_INFINITY) {
+        fprintf(stdout, "unlimited\n");
+    } else {
+        fprintf(stdout, "%lu\n", (unsigned long) (value / option->unit));
+    }
+
+    return 0;
+}
+
+/**
+ * apply_limits sets the limits collected by perform_ulimit on the
+ * current process.
+ **/
+int
+apply_limits(void *argument) {
+    struct resource_limits *limits;
+    struct rlimit limit;
+    int index;
+
+    limits = argument;
+
+    for (index = 0; index < limits->count; index++) {
+        if (getrlimit(limits->settings[index].option->resource, &limit) < 0) {
+            print_error("ulimit: Could not get limit", 0);
+            return 1;
+        }
+
+        if (limits->hard || !limits->soft) {
+            limit.rlim_max = limits->settings[index].value;
+        }
+
+        if (limits->soft || !limits->hard) {
+            limit.rlim_cur = limits->settings[index].value;
+        }
+
+        if (setrlimit(limits->settings[index].option->resource, &limit) < 0) {
+            print_error("ulimit: Could not set limit", 0);
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * perform_sched implements
+ * "sched [-c cpulist] [-n nice] [-i class[:level]] [command]".
+ * With a command, or a group such as ( a | b ), the settings apply to
+ * that command only, otherwise they apply to the shell and so to
+ * everything it starts afterwards.
+ * "sched -P cpulist" pins the stages of later pipelines one to a cpu,
+ * in order, so neighbouring stages can share a cache; "sched -P none"
+ * turns that off again.
+ **/
+int
+perform_sched(char **tokens, int token_count) {
+    struct schedule schedule;
+    int index, status;
+    char *end;
+    long nice;
+
+    (void) memset(&schedule, 0, sizeof(schedule));
+
+    for (index = 1; index < token_count && tokens[index][0] == '-'; index++) {
+        if (index + 1 == token_count) {
+            break;
+        }
+
+        if (strcmp(tokens[index], "-c") == 0) {
+            (void) free(schedule.cpus);
+            if (parse_cpu_list(tokens[++index], &schedule.cpus, &schedule.cpu_count) != 0) {
+                fprintf(stderr, "sched: %s: invalid cpu list\n", tokens[index]);
+                return 2;
+            }
+        } else if (strcmp(tokens[index], "-n") == 0) {
+            errno = 0;
+            nice = strtol(tokens[++index], &end, 10);
+            if (errno != 0 || end == tokens[index] || *end != '\0' ||
+                nice < PRIO_MIN || nice > PRIO_MAX) {
+                fprintf(stderr, "sched: %s: invalid nice value\n", tokens[index]);
+                (void) free(schedule.cpus);
+                return 2;
+            }
+            schedule.set_nice = 1;
+            schedule.nice = (int) nice;
+        } else if (strcmp(tokens[index], "-i") == 0) {
+            if (parse_io_priority(tokens[++index], &schedule) != 0) {
+                fprintf(stderr, "sched: %s: invalid io priority\n", tokens[index]);
+                (void) free(schedule.cpus);
+                return 2;
+            }
+        } else if (strcmp(tokens[index], "-P") == 0) {
+            (void) free(pipeline_cpus);
+            pipeline_cpus = NULL;
+            pipeline_cpu_count = 0;
+
+            if (strcmp(tokens[++index], "none") != 0 &&
+                parse_cpu_list(tokens[index], &pipeline_cpus, &pipeline_cpu_count) != 0) {
+                fprintf(stderr, "sched: %s: invalid cpu list\n", tokens[index]);
+                (void) free(schedule.cpus);
+                return 2;
+            }
+        } else {
+            break;
+        }
+    }
+
+    if (index < token_count && (tokens[index][0] == '-' || prefixed_group != NULL)) {
+        fprintf(stderr, "sched: Usage: sched [-c cpulist] [-n nice] "
+                        "[-i class[:level]] [-P cpulist | none] [command]\n");
+        (void) free(schedule.cpus);
+        return 2;
+    }
+
+    if (index == token_count && prefixed_group == NULL) {
+        status = apply_schedule(&schedule);
+    } else {
+        status = run_prefixed_command(tokens + index, token_count - index,
+                                      apply_schedule, &schedule);
+    }
+
+    (void) free(schedule.cpus);
+
+    return status;
+}
+
+/**
+ * apply_schedule applies the cpu affinity, nice value and io priority
+ * set in schedule to the current process.
+ **/
+int
+apply_schedule(void *argument) {
+    struct schedule *schedule;
+
+    schedule = argument;
+
+    if (schedule->cpu_count > 0 &&
+        set_cpu_affinity(schedule->cpus, schedule->cpu_count) != 0) {
+        print_error("sched: Could not set cpu affinity", 0);
+        return 1;
+    }
+
+    if (schedule->set_nice && setpriority(PRIO_PROCESS, 0, schedule->nice) < 0) {
+        print_error("sched: Could not set nice value", 0);
+        return 1;
+    }
+
+    if (schedule->io_class > 0 &&
+        set_io_priority(schedule->io_class, schedule->io_level) != 0) {
+        print_error("sched: Could not set io priority", 0);
+        return 1;
+    }
+
+    return 0;
+}
+
+/**
+ * parse_cpu_list reads a list such as "0-3,6" into a newly allocated
+ * array of cpu numbers. Nothing is left allocated when the list is not
+ * valid.
+ **/
+int
+parse_cpu_list(char *list, int **cpus, int *count) {
+    long first, last, cpu;
+    char *end;
+    int *grown, failed;
+
+    *cpus = NULL;
+    *count = 0;
+    failed = 0;
+
+    while (*list != '\0') {
+        first = strtol(list, &end, 10);
+        last = first;
+
+        if (end != list && *end == '-') {
+            list = end + 1;
+            last = strtol(list, &end, 10);
+        }
+
+        if (end == list || first < 0 || last < first || last >= MAX_CPUS ||
+            (*end != ',' && *end != '\0')) {
+            failed = 1;
+            break;
+        }
+
+        for (cpu = first; cpu <= last; cpu++) {
+            if ((grown = realloc(*cpus, (*count + 1) * sizeof(int))) == NULL) {
+                break;
+            }
+            *cpus = grown;
+            (*cpus)[(*count)++] = (int) cpu;
+        }
+
+        if (cpu <= last) {
+            failed = 1;
+            break;
+        }
+
+        list = *end == ',' ? end + 1 : end;
+    }
+
+    if (failed || *count == 0) {
+        (void) free(*cpus);
+        *cpus = NULL;
+        *count = 0;
+        return 1;
+    }
+
+    return 0;
+}
+
+/**
+ * parse_io_priority reads "realtime", "best-effort" or "idle",
+ * optionally followed by ":level" with a level from 0 (highest) to 7.
+ **/
+int
+parse_io_priority(char *priority, struct schedule *schedule) {
+    char *level;
+    size_t class_length;
+
+    schedule->io_level = 4;
+
+    if ((level = strchr(priority, ':')) != NULL) {
+        class_length = level - priority;
+        if (level[1] < '0' || level[1] > '7' || level[2] != '\0') {
+            return 1;
+        }
+        schedule->io_level = level[1] - '0';
+    } else {
+        class_length = strlen(priority);
+    }
+
+    if (strncmp(priority, "realtime", class_length) == 0 && class_length == 8) {
+        schedule->io_class = IO_CLASS_REALTIME;
+    } else if (strncmp(priority, "best-effort", class_length) == 0 && class_length == 11) {
+        schedule->io_class = IO_CLASS_BEST_EFFORT;
+    } else if (strncmp(priority, "idle", class_length) == 0 && class_length == 4) {
+        schedule->io_class = IO_CLASS_IDLE;
+        schedule->io_level = 0;
+    } else {
+        return 1;
+    }
+
+    return 0;
+}
+
+/**
+ * set_cpu_affinity restricts the current process to the given cpus.
+ **/
+int
+set_cpu_affinity(int *cpus, int count) {
+    int index;
+#if defined(__NetBSD__)
+    cpuset_t *set;
+    int result;
+
+    if ((set = cpuset_create()) == NULL) {
+        return 1;
+    }
+
+    cpuset_zero(set);
+
+    for (index = 0; index < count; index++) {
+        (void) cpuset_set(cpus[index], set);
+    }
+
+    result = sched_setaffinity_np(getpid(), cpuset_size(set), set);
+    cpuset_destroy(set);
+
+    return result != 0;
+#elif defined(__linux__)
+    cpu_set_t set;
+
+    CPU_ZERO(&set);
+
+    for (index = 0; index < count; index++) {
+        if (cpus[index] >= CPU_SETSIZE) {
+            errno = EINVAL;
+            return 1;
+        }
+        CPU_SET(cpus[index], &set);
+    }
+
+    return sched_setaffinity(0, sizeof(set), &set) != 0;
+#else
+    (void) cpus;
+    (void) count;
+    (void) index;
+    errno = EOPNOTSUPP;
+
+    return 1;
+#endif
+}
+
+/**
+ * set_io_priority sets the io scheduling class and level of the
+ * current process. Only Linux has per process io priorities.
+ **/
+int
+set_io_priority(int io_class, int io_level) {
+#if defined(__linux__) && defined(SYS_ioprio_set)
+    return syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0,
+                   (io_class << IOPRIO_CLASS_SHIFT) | io_level) != 0;
+#else
+    (void) io_class;
+    (void) io_level;
+    errno = EOPNOTSUPP;
+
+    return 1;
+#endif
+}
+
+/**
+ * perform_source implements "source file" and ". file", executing the
+ * file's commands in the shell itself. Files are split into list items
+ * once and kept in script_cache, so sourcing an unchanged file again
+ * skips reading and splitting it.
+ **/
+int
+perform_source(char **tokens, int token_count) {
+    struct list_item *items;
+    int entry, count;
+
+    if (token_count != 2) {
+        fprintf(stderr, "%s: Usage: %s file\n", tokens[0], tokens[0]);
+        return 2;
+    }
+
+    if (source_depth == SOURCE_MAX_DEPTH) {
+        fprintf(stderr, "%s: %s: too many nested sources\n", tokens[0], tokens[1]);
+        return 1;
+    }
+
+    if ((entry = load_script(tokens[0], tokens[1])) < 0) {
+        return 1;
+    }
+
+    /* The cache may grow or reload the file while the items run, so
+       only the entry's index and its items are held on to */
+    items = script_cache[entry].items;
+    count = script_cache[entry].count;
+
+    previous_exit_code = 0;
+    script_cache[entry].users++;
+    source_depth++;
+
+    (void) execute_list_items(items, count);
+
+    source_depth--;
+    script_cache[entry].users--;
+
+    return previous_exit_code;
+}
+
+/**
+ * is_script_current tells whether a cached script still matches the
+ * file. Both timestamps are compared to the nanosecond, so a rewrite
+ * of the same size within the same second is still noticed.
+ **/
+int
+is_script_current(struct script_cache_entry *entry, struct stat *file_info) {
+    return entry->modified.tv_sec == STAT_MODIFIED(*file_info).tv_sec &&
+           entry->modified.tv_nsec == STAT_MODIFIED(*file_info).tv_nsec &&
+           entry->changed.tv_sec == STAT_CHANGED(*file_info).tv_sec &&
+           entry->changed.tv_nsec == STAT_CHANGED(*file_info).tv_nsec &&
+           entry->size == file_info->st_size;
+}
+
+/**
+ * load_script returns the index of the script cache entry for path,
+ * reading and splitting the file if it is not cached or if its inode,
+ * modification or change time or size no longer match. Returns -1 on
+ * errors.
+ **/
+int
+load_script(char *name, char *path) {
+    struct stat file_info;
+    struct script_cache_entry *entry, *grown;
+    char *contents;
+    int index, fd, status, stale;
+
+    if ((fd = open(path, O_RDONLY | O_CLOEXEC)) < 0 || fstat(fd, &file_info) < 0) {
+        fprintf(stderr, "%s: %s: %s\n", name, path, strerror(errno));
+        if (fd >= 0) {
+            (void) close(fd);
+        }
+        return -1;
+    }
+
+    stale = -1;
+
+    for (index = 0; index < script_cache_count; index++) {
+        if (script_cache[index].device != file_info.st_dev ||
+            script_cache[index].inode != file_info.st_ino) {
+            continue;
+        }
+
+        if (is_script_current(&script_cache[index], &file_info)) {
+            (void) close(fd);
+            return index;
+        }
+
+        /* Stale, but the items may still be running in an outer source */
+        if (script_cache[index].users == 0) {
+            stale = index;
+        }
+    }
+
+    if (stale >= 0) {
+        entry = &script_cache[stale];
+        (void) free_list_items(entry->items, entry->count);
+    } else {
+        if ((grown = realloc(script_cache, (script_cache_count + 1) *
+                             sizeof(struct script_cache_entry))) == NULL) {
+            print_error("Could not allocate memory", 1);
+            (void) close(fd);
+            return -1;
+        }
+        script_cache = grown;
+        entry = &script_cache[script_cache_count++];
+    }
+
+    entry->items = NULL;
+    entry->count = 0;
+    entry->users = 0;
+    entry->device = file_info.st_dev;
+    entry->inode = file_info.st_ino;
+    entry->modified = STAT_MODIFIED(file_info);
+    entry->changed = STAT_CHANGED(file_info);
+    entry->size = file_info.st_size;
+
+    contents = read_script(fd, file_info.st_size);
+    (void) close(fd);
+
+    if (contents == NULL) {
+        fprintf(stderr, "%s: %s: %s\n", name, path, strerror(errno));
+        entry->size = -1;
+        return -1;
+    }
+
+    (void) strip_comments(contents);
+    status = split_list(contents, &entry->items, &entry->count);
+    (void) free(contents);
+
+    if (status != 0) {
+        print_error("Could not allocate memory", 1);
+        entry->size = -1;
+        return -1;
+    }
+
+    return entry - script_cache;
+}
+
+/**
+ * read_script reads size bytes, or whatever is there if the file
+ * changed in the meantime, from fd into a string.
+ **/
+char *
+read_script(int fd, off_t size) {
+    char *contents;
+    ssize_t bytes;
+    size_t length;
+
+    if ((contents = malloc(size + 1)) == NULL) {
+        return NULL;
+    }
+
+    for (length = 0; length < (size_t) size; length += bytes) {
+        if ((bytes = read(fd, contents + length, size - length)) < 0) {
+            if (errno == EINTR) {
+                bytes = 0;
+                continue;
+            }
+            (void) free(contents);
+            return NULL;
+        } else if (bytes == 0) {
+            break;
+        }
+    }
+
+    contents[length] = '\0';
+
+    return contents;
+}
+
+/**
+ * strip_comments blanks out everything from a # that starts a word to
+ * the end of its line.
+ **/
+void
+strip_comments(char *script) {
+    int index;
+
+    for (index = 0; script[index] != '\0'; index++) {
+        if (script[index] != '#' ||
+            (index > 0 && !isspace((unsigned char) script[index - 1]))) {
+            continue;
+        }
+
+        for (; script[index] != '\0' && script[index] != '\n'; index++) {
+            script[index] = ' ';
+        }
+
+        if (script[index] == '\0') {
+            break;
+        }
+    }
+}
+
+/**
+ * perform_coproc implements "coproc NAME command [argument ...]". The
+ * command runs in the background with its stdin and stdout connected
+ * to the shell through pipes. The shell's ends are stored in the array
+ * NAME, ${NAME[0]} to read the command's output and ${NAME[1]} to
+ * write to its input, e.g. with <&${NAME[0]} and >&${NAME[1]}, and its
+ * pid in NAME_PID. Without arguments the running coprocesses are
+ * listed.
+ **/
+int
+perform_coproc(char **tokens, int token_count) {
+    struct coprocess *grown;
+    char *name, *pid_name, *values[2], numbers[2][16], pid_number[16];
+    int to_child[2], from_child[2], index, input_fd, output_fd, status;
+    pid_t child;
+
+    if (token_count == 1) {
+        for (index = 0; index < coprocess_count; index++) {
+            fprintf(stdout, "%s\t%ld\t%d\t%d\n", coprocesses[index].name,
+                    (long) coprocesses[index].pid, coprocesses[index].input_fd,
+                    coprocesses[index].output_fd);
+        }
+        return 0;
+    }
+
+    if (token_count < 3 || !is_variable_name(tokens[1])) {
+        fprintf(stderr, "coproc: Usage: coproc NAME command [argument ...]\n");
+        return 2;
+    }
+
+    for (index = 0; index < coprocess_count; index++) {
+        if (strcmp(coprocesses[index].name, tokens[1]) == 0) {
+            fprintf(stderr, "coproc: %s: already running\n", tokens[1]);
+            return 1;
+        }
+    }
+
+    name = NULL;
+    pid_name = NULL;
+
+    /* Everything that can fail is done before the coprocess exists, so
+       a running coprocess is always tracked */
+    if ((name = strdup(tokens[1])) == NULL ||
+        (pid_name = malloc(strlen(tokens[1]) + 5)) == NULL ||
+        (grown = realloc(coprocesses, (coprocess_count + 1) *
+                         sizeof(struct coprocess))) == NULL) {
+        print_error("Could not allocate memory", 1);
+        (void) free(name);
+        (void) free(pid_name);
+        return 1;
+    }
+
+    coprocesses = grown;
+
+    if (pipe2(to_child, O_CLOEXEC)) {
+        print_error("Could not create a pipe", 1);
+        (void) free(name);
+        (void) free(pid_name);
+        return 1;
+    }
+
+    if (pipe2(from_child, O_CLOEXEC)) {
+        print_error("Could not create a pipe", 1);
+        (void) close(to_child[0]);
+        (void) close(to_child[1]);
+        (void) free(name);
+        (void) free(pid_name);
+        return 1;
+    }
+
+    if ((child = fork_child()) < 0) {
+        print_error("Could not fork a child", 1);
+        (void) close(to_child[0]);
+        (void) close(to_child[1]);
+        (void) close(from_child[0]);
+        (void) close(from_child[1]);
+        (void) free(name);
+        (void) free(pid_name);
+        return 1;
+    } else if (child == 0) {
+        if (dup2(to_child[0], STDIN_FILENO) != STDIN_FILENO ||
+            dup2(from_child[1], STDOUT_FILENO) != STDOUT_FILENO) {
+            fprintf(stderr, "Could not duplicate fd: %s \n", strerror(errno));
+            exit(127);
+        }
+
+        (void) close(to_child[0]);
+        (void) close(to_child[1]);
+        (void) close(from_child[0]);
+        (void) close(from_child[1]);
+
+        /* Holding another coprocess's input open would keep it from
+           ever seeing end of file */
+        for (index = 0; index < coprocess_count; index++) {
+            (void) close(coprocesses[index].input_fd);
+            (void) close(coprocesses[index].output_fd);
+        }
+
+        (void) adopt_standard_descriptors();
+
+        execute_in_place = 1;
+        exit(run_simple_command(tokens + 2, token_count - 2));
+    }
+
+    (void) close(to_child[0]);
+    (void) close(from_child[1]);
+
+    /* Kept above the descriptors commands use, like the shell's own,
+       unless there is no room up there */
+    if ((input_fd = duplicate_shell_descriptor(from_child[0])) < 0) {
+        input_fd = from_child[0];
+    } else {
+        (void) close(from_child[0]);
+    }
+    if ((output_fd = duplicate_shell_descriptor(to_child[1])) < 0) {
+        output_fd = to_child[1];
+    } else {
+        (void) close(to_child[1]);
+    }
+
+    coprocesses[coprocess_count].pid = child;
+    coprocesses[coprocess_count].input_fd = input_fd;
+    coprocesses[coprocess_count].output_fd = output_fd;
+    coprocesses[coprocess_count].name = name;
+    coprocess_count++;
+
+    (void) sprintf(numbers[0], "%d", input_fd);
+    (void) sprintf(numbers[1], "%d", output_fd);
+    (void) sprintf(pid_number, "%ld", (long) child);
+    (void) sprintf(pid_name, "%s_PID", tokens[1]);
+    values[0] = numbers[0];
+    values[1] = numbers[1];
+
+    status = set_variable(tokens[1], values, 2);
+    values[0] = pid_number;
+    status |= set_variable(pid_name, values, 1);
+    (void) free(pid_name);
+
+    if (status != 0) {
+        print_error("Could not allocate memory", 1);
+        return 1;
+    }
+
+    return 0;
+}
+
+/**
+ * reap_coprocess forgets the coprocess with the given pid once it has
+ * exited: its pipes are closed and NAME and NAME_PID are emptied.
+ * Returns 1 if pid was a coprocess.
+ **/
+int
+reap_coprocess(pid_t pid) {
+    char *pid_name;
+    int index;
+
+    for (index = 0; index < coprocess_count; index++) {
+        if (coprocesses[index].pid == pid) {
+            break;
+        }
+    }
+
+    if (index == coprocess_count) {
+        return 0;
+    }
+
+    (void) close(coprocesses[index].input_fd);
+    (void) close(coprocesses[index].output_fd);
+    (void) set_variable(coprocesses[index].name, NULL, 0);
+
+    if ((pid_name = malloc(strlen(coprocesses[index].name) + 5)) != NULL) {
+        (void) sprintf(pid_name, "%s_PID", coprocesses[index].name);
+        (void) set_variable(pid_name, NULL, 0);
+        (void) free(pid_name);
+    }
+
+    (void) free(coprocesses[index].name);
+    (void) memmove(coprocesses + index, coprocesses + index + 1,
+                   (coprocess_count - index - 1) * sizeof(struct coprocess));
+    coprocess_count--;
+
+    return 1;
+}
+
+/**
+ * perform_read implements "read [-u fd] [name ...]". It reads one line
+ * from fd, stdin by default, a byte at a time so that nothing after the
+ * line is consumed, and splits it on blanks into the named variables,
+ * the last one taking the rest of the line. Without names the whole
+ * line is stored in REPLY. Returns 1 at end of file.
+ **/
+int
+perform_read(char **tokens, int token_count) {
+    char *line, *word, *end, character, *reply;
+    int index, fd, length, capacity, first_name;
+    ssize_t bytes;
+
+    fd = STDIN_FILENO;
+    first_name = 1;
+
+    if (token_count > 2 && strcmp(tokens[1], "-u") == 0) {
+        fd = (int) strtol(tokens[2], &end, 10);
+        if (end == tokens[2] || *end != '\0' || fd < 0) {
+            fprintf(stderr, "read: %s: invalid file descriptor\n", tokens[2]);
+            return 2;
+        }
+        first_name = 3;
+    }
+
+    for (index = first_name; index < token_count; index++) {
+        if (!is_variable_name(tokens[index])) {
+            fprintf(stderr, "read: %s: not a valid identifier\n", tokens[index]);
+            return 2;
+        }
+    }
+
+    line = NULL;
+    length = 0;
+    capacity = 0;
+
+    if (append_to_buffer(&line, &length, &capacity, "", 0) != 0) {
+        print_error("Could not allocate memory", 1);
+        return 1;
+    }
+
+    for (;;) {
+        if ((bytes = read(fd, &character, 1)) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            fprintf(stderr, "read: %s\n", strerror(errno));
+            (void) free(line);
+            return 1;
+        }
+
+        if (bytes == 0 || character == '\n') {
+            break;
+        }
+
+        if (append_to_buffer(&line, &length, &capacity, &character, 1) != 0) {
+            print_error("Could not allocate memory", 1);
+            return 1;
+        }
+    }
+
+    if (first_name == token_count) {
+        reply = line;
+        (void) set_variable("REPLY", &reply, 1);
+    }
+
+    for (word = line, index = first_name; index < token_count; index++) {
+        while (*word == ' ' || *word == '\t') {
+            word++;
+        }
+
+        if (index == token_count - 1) {
+            for (end = word + strlen(word);
+                 end > word && (end[-1] == ' ' || end[-1] == '\t'); end--) {
+                continue;
+            }
+        } else {
+            for (end = word; *end != '\0' && *end != ' ' && *end != '\t'; end++) {
+                continue;
+            }
+        }
+
+        reply = word;
+        word = *end != '\0' ? end + 1 : end;
+        *end = '\0';
+
+        if (set_variable(tokens[index], &reply, 1) != 0) {
+            print_error("Could not allocate memory", 1);
+            (void) free(line);
+            return 1;
+        }
+    }
+
+    (void) free(line);
+
+    return bytes == 0;
+}
+
+/**
+ * perform_mapfile implements "mapfile [-t] [-n count] [-u fd]
+ * [-C callback [-c quantum]] [name]", also known as readarray. It
+ * stores the lines read from fd, stdin by default, in the array name,
+ * MAPFILE by default, at most count of them when count is given. -t
+ * drops the newline from each line. The callback is run with the index
+ * and the line every quantum lines, 5000 by default, before the line is
+ * stored. Regular files are mapped and split in place, anything else
+ * is read in large chunks; only with a count it is read a byte at a
+ * time, so that nothing past the last line is consumed.
+ **/
+int
+perform_mapfile(char **tokens, int token_count) {
+    struct mapfile_options options;
+    struct stat file_info;
+    char *name, *data, *buffer, *map, **lines, *end;
+    size_t length, consumed;
+    off_t offset;
+    long value;
+    int index, fd, count, status;
+
+    options.count = 0;
+    options.strip = 0;
+    options.quantum = MAPFILE_QUANTUM;
+    options.callback = NULL;
+    fd = STDIN_FILENO;
+    name = "MAPFILE";
+
+    for (index = 1; index < token_count && tokens[index][0] == '-'; index++) {
+        if (strcmp(tokens[index], "-t") == 0) {
+            options.strip = 1;
+            continue;
+        }
+
+        if (index + 1 == token_count) {
+            break;
+        }
+
+        if (strcmp(tokens[index], "-C") == 0) {
+            options.callback = tokens[++index];
+            continue;
+        }
+
+        value = strtol(tokens[index + 1], &end, 10);
+        if (end == tokens[index + 1] || *end != '\0' || value < 0 || value > INT_MAX) {
+            fprintf(stderr, "%s: %s: invalid number\n", tokens[0], tokens[index + 1]);
+            return 2;
+        }
+
+        if (strcmp(tokens[index], "-n") == 0) {
+            options.count = (int) value;
+        } else if (strcmp(tokens[index], "-u") == 0) {
+            fd = (int) value;
+        } else if (strcmp(tokens[index], "-c") == 0 && value > 0) {
+            options.quantum = (int) value;
+        } else {
+            break;
+        }
+        index++;
+    }
+
+    if (index + 1 < token_count || (index < token_count && !is_variable_name(tokens[index]))) {
+        fprintf(stderr, "%s: Usage: %s [-t] [-n count] [-u fd] [-C callback [-c quantum]] "
+                        "[name]\n", tokens[0], tokens[0]);
+        return 2;
+    }
+
+    if (index < token_count) {
+        name = tokens[index];
+    }
+
+    if (fstat(fd, &file_info) < 0) {
+        fprintf(stderr, "%s: %d: %s\n", tokens[0], fd, strerror(errno));
+        return 1;
+    }
+
+    map = NULL;
+    buffer = NULL;
+    offset = -1;
+
+    if (S_ISREG(file_info.st_mode) && (offset = lseek(fd, 0, SEEK_CUR)) >= 0) {
+        length = offset < file_info.st_size ? file_info.st_size - offset : 0;
+
+        if (length > 0 && (map = mmap(NULL, file_info.st_size, PROT_READ, MAP_PRIVATE,
+                                      fd, 0)) == MAP_FAILED) {
+            fprintf(stderr, "%s: %s\n", tokens[0], strerror(errno));
+            return 1;
+        }
+        data = length > 0 ? map + offset : "";
+    } else {
+        if (read_stream(fd, options.count, &buffer, &length) != 0) {
+            fprintf(stderr, "%s: %s\n", tokens[0], strerror(errno));
+            return 1;
+        }
+        data = buffer;
+    }
+
+    status = split_lines(data, length, &options, &lines, &count, &consumed);
+
+    if (map != NULL) {
+        (void) munmap(map, file_info.st_size);
+    }
+    (void) free(buffer);
+
+    /* Leave a regular file positioned after the lines that were taken */
+    if (offset >= 0) {
+        (void) lseek(fd, offset + consumed, SEEK_SET);
+    }
+
+    if (status != 0) {
+        print_error("Could not allocate memory", 1);
+        return 1;
+    }
+
+    if (store_variable(name, lines, count) != 0) {
+        print_error("Could not allocate memory", 1);
+        (void) free_arguments(lines);
+        return 1;
+    }
+
+    return 0;
+}
+
+/**
+ * read_stream reads fd to its end, in large chunks, or when line_limit
+ * is given a byte at a time up to that many lines.
+ **/
+int
+read_stream(int fd, int line_limit, char **buffer, size_t *length) {
+    size_t capacity;
+    ssize_t bytes;
+    char *grown;
+    int lines;
+
+    *length = 0;
+    capacity = line_limit > 0 ? BATCH_READ_SIZE : MAPFILE_READ_SIZE;
+    lines = 0;
+
+    if ((*buffer = malloc(capacity)) == NULL) {
+        return 1;
+    }
+
+    for (;;) {
+        if (*length == capacity) {
+            capacity *= 2;
+            if ((grown = shell_realloc(*buffer, capacity)) == NULL) {
+                (void) free(*buffer);
+                *buffer = NULL;
+                return 1;
+            }
+            *buffer = grown;
+        }
+
+        if ((bytes = read(fd, *buffer + *length,
+                          line_limit > 0 ? 1 : capacity - *length)) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            (void) free(*buffer);
+            *buffer = NULL;
+            return 1;
+        } else if (bytes == 0) {
+            return 0;
+        }
+
+        *length += bytes;
+
+        if (line_limit > 0 && (*buffer)[*length - 1] == '\n' && ++lines == line_limit) {
+            return 0;
+        }
+    }
+}
+
+/**
+ * split_lines copies the lines of data into a NULL terminated array,
+ * taking at most options->count lines when that is set and running the
+ * callback every options->quantum lines. consumed is set to the number
+ * of bytes the lines taken span. Nothing is left allocated on failure.
+ **/
+int
+split_lines(char *data, size_t length, struct mapfile_options *options,
+            char ***lines, int *count, size_t *consumed) {
+    char **grown, *line, *newline, *end;
+    size_t line_length;
+    int capacity;
+
+    *count = 0;
+    capacity = 1024;
+    end = data + length;
+
+    if ((*lines = malloc((capacity + 1) * sizeof(char *))) == NULL) {
+        return 1;
+    }
+
+    for (line = data; line < end && (options->count == 0 || *count < options->count);
+         line += line_length) {
+        if ((newline = memchr(line, '\n', end - line)) == NULL) {
+            line_length = end - line;
+        } else {
+            line_length = newline - line + 1;
+        }
+
+        if (*count == capacity) {
+            capacity *= 2;
+            if ((grown = realloc(*lines, (capacity + 1) * sizeof(char *))) == NULL) {
+                (*lines)[*count] = NULL;
+                (void) free_arguments(*lines);
+                return 1;
+            }
+            *lines = grown;
+        }
+
+        if (((*lines)[*count] = malloc(line_length + 1)) == NULL) {
+            (void) free_arguments(*lines);
+            return 1;
+        }
+
+        (void) memcpy((*lines)[*count], line, line_length);
+        (*lines)[*count][line_length - (options->strip && newline != NULL)] = '\0';
+
+        if (options->callback != NULL && (*count + 1) % options->quantum == 0) {
+            (void) run_mapfile_callback(options->callback, *count, (*lines)[*count]);
+        }
+
+        (*count)++;
+    }
+
+    (*lines)[*count] = NULL;
+    *consumed = line - data;
+
+    return 0;
+}
+
+/**
+ * run_mapfile_callback runs callback with the index and the line as its
+ * two arguments. The line is passed as it is, never parsed by the shell.
+ **/
+int
+run_mapfile_callback(char *callback, int index, char *line) {
+    char *arguments[4], number[32];
+    int in_place, status;
+
+    (void) sprintf(number, "%d", index);
+    arguments[0] = callback;
+    arguments[1] = number;
+    arguments[2] = line;
+    arguments[3] = NULL;
+
+    /* mapfile is still running, so the callback must not replace the shell */
+    in_place = execute_in_place;
+    execute_in_place = 0;
+    status = run_simple_command(arguments, 3);
+    execute_in_place = in_place;
+
+    return status;
+}
+
+/**
+ * is_variable_name tells whether name can be used as a variable name.
+ **/
+int
+is_variable_name(char *name) {
+    int index;
+
+    for (index = 0; name[index] != '\0'; index++) {
+        if (!is_name_character(name[index], index == 0)) {
+            return 0;
+        }
+    }
+
+    return index > 0;
+}
+
+/**
+ * open_record opens the file every line executed is logged to, as
+ * tab separated start time, duration, exit status and the line.
+ **/
+int
+open_record(char *path) {
+    int fd;
+
+    if ((fd = open(path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644)) < 0 ||
+        (record_file = fdopen(fd, "a")) == NULL) {
+        print_error("Could not open record file", 1);
+        return 1;
+    }
+
+    return 0;
+}
+
+/**
+ * execute_timed_line executes line and, when a session is recorded,
+ * logs it along with when it started, how long it took and its exit
+ * status. The duration is also stored in duration if that is given.
+ **/
+void
+execute_timed_line(char *line, double *duration) {
+    struct timespec now;
+    double start, elapsed;
 
-                tokens[index] = "<";
-                index++;
-                token_count++;
-            } else {
-                (void) append_char(temp, token[token_index]);
-            }
+    (void) clock_gettime(CLOCK_REALTIME, &now);
+    start = monotonic_seconds();
+
+    (void) execute_input_line(line);
+
+    elapsed = monotonic_seconds() - start;
+
+    if (duration != NULL) {
+        *duration = elapsed;
+    }
+
+    if (record_file != NULL) {
+        fprintf(record_file, "%ld.%06ld\t%.6f\t%d\t%s\n", (long) now.tv_sec,
+                now.tv_nsec / 1000, elapsed, previous_exit_code, line);
+        (void) fflush(record_file);
+    }
+}
+
+/**
+ * replay_session executes the lines of a recorded session again and
+ * reports to stderr, per line, the recorded and the new duration, the
+ * change between them and the exit status, with both statuses shown
+ * when they differ. Returns 1 if any status differed.
+ **/
+int
+replay_session(char *path) {
+    FILE *recording;
+    char *record, **records, **grown, *line;
+    size_t record_size;
+    double original, replayed, original_total, replayed_total;
+    int index, record_count, status, mismatches;
+
+    if ((recording = fopen(path, "r")) == NULL) {
+        print_error("Could not open recording", 1);
+        return 1;
+    }
+
+    record = NULL;
+    record_size = 0;
+    records = NULL;
+    record_count = 0;
+
+    /* The whole recording is read up front: a forked child exiting
+       would otherwise move the shared file offset under the stream */
+    while (getline(&record, &record_size, recording) != -1) {
+        if ((grown = realloc(records, (record_count + 1) * sizeof(char *))) == NULL ||
+            (grown[record_count] = strdup(record)) == NULL) {
+            print_error("Could not allocate memory", 1);
+            return 1;
         }
+        records = grown;
+        (void) strip_new_line(records[record_count++]);
+    }
 
-        if (strlen(temp) > 0) {
-            if ((tokens[index] = strdup(temp)) == NULL) {
-                print_error("Could not allocate memory", 1);
-                previous_exit_code = 127;
+    (void) free(record);
+    (void) fclose(recording);
+
+    original_total = 0;
+    replayed_total = 0;
+    mismatches = 0;
+
+    fprintf(stderr, "%10s %10s %8s %7s  %s\n", "recorded", "replayed", "change", "status",
+            "command");
+
+    for (index = 0; index < record_count; index++) {
+        if (parse_record(records[index], &original, &status, &line) != 0) {
+            fprintf(stderr, "%s: replay: %s: malformed record\n", getprogname(),
+                    records[index]);
+            continue;
+        }
+
+        (void) fflush(stdout);
+        (void) execute_timed_line(line, &replayed);
+        (void) fflush(stdout);
+
+        original_total += original;
+        replayed_total += replayed;
+
+        if (status != previous_exit_code) {
+            mismatches++;
+        }
+
+        fprintf(stderr, "%10.6f %10.6f %+7.1f%% %3d", original, replayed,
+                original > 0 ? (replayed - original) / original * 100 : 0.0, status);
+        if (status != previous_exit_code) {
+            fprintf(stderr, "->%-3d %s\n", previous_exit_code, line);
+        } else {
+            fprintf(stderr, "      %s\n", line);
+        }
+    }
+
+    fprintf(stderr, "%10.6f %10.6f %+7.1f%%        total, %d status changes\n",
+            original_total, replayed_total, original_total > 0 ?
+            (replayed_total - original_total) / original_total * 100 : 0.0, mismatches);
+
+    for (index = 0; index < record_count; index++) {
+        (void) free(records[index]);
+    }
+    (void) free(records);
+
+    return mismatches > 0;
+}
+
+/**
+ * parse_record splits a recorded line into its fields: the start time,
+ * which is skipped, the duration, the exit status and the line.
+ **/
+int
+parse_record(char *record, double *duration, int *status, char **line) {
+    char *field;
+
+    if ((field = strchr(record, '\t')) == NULL) {
+        return 1;
+    }
+
+    *duration = strtod(field + 1, &field);
+    if (*field != '\t' || *duration < 0) {
+        return 1;
+    }
+
+    *status = (int) strtol(field + 1, &field, 10);
+    if (*field != '\t') {
+        return 1;
+    }
+
+    *line = field + 1;
+
+    return 0;
+}
+
+/**
+ * open_history opens the history file, $SISH_HISTFILE or
+ * ~/.sish_history, for appending. Nothing is read yet: the file is
+ * only mapped and indexed the first time the history is searched.
+ **/
+void
+open_history() {
+    struct passwd *user_info;
+    char *directory;
+
+    shell_history.fd = -1;
+
+    if ((shell_history.path = getenv("SISH_HISTFILE")) == NULL) {
+        if ((directory = getenv("HOME")) == NULL) {
+            if ((user_info = getpwuid(getuid())) == NULL) {
                 return;
             }
-            index++;
-            token_count++;
+            directory = user_info->pw_dir;
         }
 
-        token = strtok_r(NULL, " \t", &last);
-        (void) free(temp);
+        if ((shell_history.path = malloc(strlen(directory) +
+                                         strlen(HISTORY_FILE) + 2)) == NULL) {
+            return;
+        }
+        (void) sprintf(shell_history.path, "%s/%s", directory, HISTORY_FILE);
     }
 
-    tokens[index] = '\0';
+    shell_history.fd = open(shell_history.path,
+                            O_RDWR | O_APPEND | O_CREAT | O_CLOEXEC, 0600);
+}
 
-    if (replace_dollars_in_tokens(tokens, token_count) != 0) {
-        previous_exit_code = 127;
-        return;
+/**
+ * load_history maps the history file and indexes where each line
+ * starts. The lines stay in the mapping and are only paged in when
+ * they are looked at.
+ **/
+int
+load_history() {
+    struct stat file_info;
+    char *line, *end, *newline;
+
+    if (shell_history.loaded) {
+        return 0;
     }
 
-    if ((redirection_status = redirect_file_descriptors(tokens, token_count)) != 0) {
-        previous_exit_code = redirection_status;
-        return;
+    shell_history.loaded = 1;
+
+    if (shell_history.fd < 0 || fstat(shell_history.fd, &file_info) < 0 ||
+        file_info.st_size == 0) {
+        return 0;
     }
 
-    if (tokens[0] == '\0') {
-        (void) free(tokens);
-        (void) free(command_copy);
-        (void) reset_file_descriptors();
+    if ((shell_history.map = mmap(NULL, file_info.st_size, PROT_READ, MAP_PRIVATE,
+                                  shell_history.fd, 0)) == MAP_FAILED) {
+        shell_history.map = NULL;
+        print_error("history: Could not map history file", 0);
+        return 1;
+    }
+
+    shell_history.map_length = file_info.st_size;
+    end = shell_history.map + shell_history.map_length;
+
+    for (line = shell_history.map; line < end; line = newline + 1) {
+        if ((newline = memchr(line, '\n', end - line)) == NULL) {
+            newline = end;
+        }
+
+        if (newline > line && append_history_entry(line, newline - line) != 0) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * append_history_entry adds a line to the in-memory index, keeping the
+ * prefix index sorted if it has been built.
+ **/
+int
+append_history_entry(char *line, size_t length) {
+    struct history_entry *grown_entries;
+    int *grown_sorted, low, high, middle;
+
+    if (shell_history.count == shell_history.capacity) {
+        shell_history.capacity = shell_history.capacity ? shell_history.capacity * 2 : 1024;
+
+        if ((grown_entries = realloc(shell_history.entries, shell_history.capacity *
+                                     sizeof(struct history_entry))) == NULL) {
+            print_error("Could not allocate memory", 1);
+            return 1;
+        }
+        shell_history.entries = grown_entries;
+
+        if (shell_history.sorted != NULL) {
+            if ((grown_sorted = realloc(shell_history.sorted,
+                                        shell_history.capacity * sizeof(int))) == NULL) {
+                print_error("Could not allocate memory", 1);
+                return 1;
+            }
+            shell_history.sorted = grown_sorted;
+        }
+    }
+
+    shell_history.entries[shell_history.count].line = line;
+    shell_history.entries[shell_history.count].length = length;
+
+    if (shell_history.sorted != NULL) {
+        low = 0;
+        high = shell_history.count;
+        while (low < high) {
+            middle = (low + high) / 2;
+            if (compare_history_lines(line, length,
+                                      &shell_history.entries[shell_history.sorted[middle]]) > 0) {
+                low = middle + 1;
+            } else {
+                high = middle;
+            }
+        }
+
+        (void) memmove(shell_history.sorted + low + 1, shell_history.sorted + low,
+                       (shell_history.count - low) * sizeof(int));
+        shell_history.sorted[low] = shell_history.count;
+    }
+
+    shell_history.count++;
+
+    return 0;
+}
+
+/**
+ * add_history records a line typed at the prompt. It is appended to
+ * the file in a single write, so shells sharing the file do not mix
+ * up their lines, and to the index if that has been loaded.
+ **/
+void
+add_history(char *line) {
+    struct iovec vector[2];
+    char *copy;
+    size_t length;
+
+    if (is_blank_string(line)) {
         return;
     }
 
-    token_count = reiterate_token_count(tokens);
+    length = strlen(line);
 
-    if (input_flags.x_flag) {
-        if (print_command(tokens, token_count) != 0) {
+    if (shell_history.fd >= 0) {
+        vector[0].iov_base = line;
+        vector[0].iov_len = length;
+        vector[1].iov_base = "\n";
+        vector[1].iov_len = 1;
+        (void) writev(shell_history.fd, vector, 2);
+    }
+
+    if (shell_history.loaded) {
+        if ((copy = strdup(line)) == NULL) {
+            print_error("Could not allocate memory", 1);
             return;
         }
+        (void) append_history_entry(copy, length);
     }
+}
 
-    if (strcmp(tokens[0], "cd") == 0) {
-        if (token_count == 1) {
-            status = perform_directory_change(NULL);
-        } else {
-            status = perform_directory_change(tokens[1]);
+/**
+ * compare_history_lines orders line against a history entry the way
+ * the prefix index is sorted.
+ **/
+int
+compare_history_lines(char *line, size_t length, struct history_entry *entry) {
+    int result;
+
+    if ((result = memcmp(line, entry->line,
+                         length < entry->length ? length : entry->length)) != 0) {
+        return result;
+    }
+
+    return length < entry->length ? -1 : length > entry->length;
+}
+
+int
+compare_history_indexes(const void *first, const void *second) {
+    struct history_entry *entry;
+
+    entry = &shell_history.entries[*(const int *) first];
+
+    return compare_history_lines(entry->line, entry->length,
+                                 &shell_history.entries[*(const int *) second]);
+}
+
+/**
+ * find_history_prefix returns the most recent history entry starting
+ * with prefix, or -1. The first lookup sorts the entries into a prefix
+ * index, which is then kept up to date as lines are added, so finding
+ * the matching range is a binary search.
+ **/
+int
+find_history_prefix(char *prefix, size_t length) {
+    struct history_entry *entry;
+    int index, low, high, middle, found;
+
+    if (load_history() != 0) {
+        return -1;
+    }
+
+    if (shell_history.sorted == NULL) {
+        if ((shell_history.sorted = malloc((shell_history.capacity + 1) * sizeof(int))) == NULL) {
+            print_error("Could not allocate memory", 1);
+            return -1;
         }
-    } else if (strcmp(tokens[0], "echo") == 0) {
-        status = perform_echo(tokens, token_count, command_length);
-    } else {
-        status = perform_exec(tokens);
+
+        for (index = 0; index < shell_history.count; index++) {
+            shell_history.sorted[index] = index;
+        }
+
+        qsort(shell_history.sorted, shell_history.count, sizeof(int),
+              compare_history_indexes);
     }
 
-    previous_exit_code = status;
+    low = 0;
+    high = shell_history.count;
+    while (low < high) {
+        middle = (low + high) / 2;
+        if (compare_history_lines(prefix, length,
+                                  &shell_history.entries[shell_history.sorted[middle]]) > 0) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
 
-    (void) free(tokens);
-    (void) free(command_copy);
+    found = -1;
+    for (index = low; index < shell_history.count; index++) {
+        entry = &shell_history.entries[shell_history.sorted[index]];
+        if (entry->length < length || memcmp(entry->line, prefix, length) != 0) {
+            break;
+        }
+        if (shell_history.sorted[index] > found) {
+            found = shell_history.sorted[index];
+        }
+    }
 
-    (void) reset_file_descriptors();
+    return found;
 }
 
+/**
+ * search_history returns the most recent entry before start that
+ * contains text, or -1.
+ **/
 int
-print_command(char **tokens, int token_count) {
-    char *command_print;
-    int index, total_output_length;
+search_history(char *text, size_t length, int start) {
+    int index;
 
-    total_output_length = token_count + 1;
+    if (load_history() != 0) {
+        return -1;
+    }
 
-    if ((command_print = malloc(total_output_length)) == NULL) {
-        print_error("cd: Could not allocate memory", 0);
-        return 127;
+    for (index = start - 1; index >= 0; index--) {
+        if (memmem(shell_history.entries[index].line, shell_history.entries[index].length,
+                   text, length) != NULL) {
+            return index;
+        }
     }
 
-    command_print[0] = '\0';
+    return -1;
+}
 
-    for (index = 0; index < token_count; index++) {
-        if (index > 0) {
-            if (strcat(command_print, " ") == NULL) {
-                print_error("cd: Internal error: ", 0);
+/**
+ * expand_history replaces the history references !!, !n, !-n and
+ * !prefix that start a word in line with the entry they refer to.
+ * Returns 0 and sets expanded to NULL when there is nothing to expand,
+ * 1 with the new line in expanded, or -1 if an event was not found.
+ **/
+int
+expand_history(char *line, char **expanded) {
+    char *word;
+    int index, end, length, capacity, entry, number;
+
+    *expanded = NULL;
+    length = 0;
+    capacity = 0;
+
+    for (index = 0; line[index] != '\0'; index = end) {
+        end = index + 1;
+
+        if (line[index] != '!' || (index > 0 && !isspace((unsigned char) line[index - 1])) ||
+            line[end] == '\0' || isspace((unsigned char) line[end]) ||
+            line[end] == '=' || line[end] == '(') {
+            if (*expanded != NULL &&
+                append_to_buffer(expanded, &length, &capacity, line + index, 1) != 0) {
+                return -1;
             }
+            continue;
         }
 
-        if (strcat(command_print, tokens[index]) == NULL) {
-            print_error("cd: Internal error: ", 0);
+        while (line[end] != '\0' && !isspace((unsigned char) line[end])) {
+            end++;
+        }
+
+        if (load_history() != 0) {
+            return -1;
+        }
+
+        word = line + index + 1;
+        if (*word == '!') {
+            entry = shell_history.count - 1;
+            end = index + 2;
+        } else if (isdigit((unsigned char) *word) ||
+                   (*word == '-' && isdigit((unsigned char) word[1]))) {
+            number = (int) strtol(word, &word, 10);
+            entry = number < 0 ? shell_history.count + number : number - 1;
+            end = word - line;
+        } else {
+            entry = find_history_prefix(word, end - index - 1);
+        }
+
+        if (entry < 0 || entry >= shell_history.count) {
+            fprintf(stderr, "%s: %.*s: event not found\n", getprogname(), end - index,
+                    line + index);
+            (void) free(*expanded);
+            *expanded = NULL;
+            return -1;
+        }
+
+        if ((*expanded == NULL &&
+             append_to_buffer(expanded, &length, &capacity, line, index) != 0) ||
+            append_to_buffer(expanded, &length, &capacity,
+                             shell_history.entries[entry].line,
+                             (int) shell_history.entries[entry].length) != 0) {
+            return -1;
         }
     }
 
-    fprintf(stderr, "+ %s\n", command_print);
+    return *expanded != NULL;
+}
+
+/**
+ * perform_history implements "history [count]", printing the last
+ * count entries, or all of them, with the numbers !n refers to.
+ **/
+int
+perform_history(char **tokens, int token_count) {
+    int index, count;
+
+    if (token_count > 2 || (token_count == 2 && (count = parse_positive_number(tokens[1])) < 0)) {
+        fprintf(stderr, "history: Usage: history [count]\n");
+        return 2;
+    }
+
+    if (load_history() != 0) {
+        return 1;
+    }
+
+    index = (token_count == 2 && count < shell_history.count) ?
+            shell_history.count - count : 0;
 
-    (void) free(command_print);
+    for (; index < shell_history.count; index++) {
+        fprintf(stdout, "%5d  %.*s\n", index + 1, (int) shell_history.entries[index].length,
+                shell_history.entries[index].line);
+    }
 
-    return 0;   
+    return 0;
 }
 
 /**
- * get_char_count gets the number of characters
- * present in the input that are seperated by the
- * space delimiter.
+ * read_input_line prints the prompt and reads the next line into line,
+ * without the trailing newline. On a terminal the line can be edited
+ * and the history recalled. Returns -1 at end of input.
  **/
 int
-get_char_count(char *command, char *delimiter) {
-    char *last, *token, *command_copy;
-    int token_count;
+read_input_line(char **line, size_t *size) {
+    struct termios saved, raw;
+    int result;
+
+    if (!isatty(STDIN_FILENO) || tcgetattr(STDIN_FILENO, &saved) < 0) {
+        fprintf(stdout, "%s$ ", getprogname());
+        /* isatty leaves ENOTTY behind, end of input is not an error */
+        errno = 0;
+        if (getline(line, size, stdin) == -1) {
+            return -1;
+        }
 
-    token_count = 0;
+        /* getline also includes the '\n' at the end, hence we replace it by null*/
+        (void) strip_new_line(*line);
+        return 0;
+    }
 
-    /* String duplication is required as strtok modifies the orignal string */
-    if ((command_copy = strdup(command)) == NULL) {
+    raw = saved;
+    raw.c_lflag &= ~(ECHO | ICANON | ISIG | IEXTEN);
+    raw.c_iflag &= ~(IXON | ICRNL);
+    raw.c_cc[VMIN] = 1;
+    raw.c_cc[VTIME] = 0;
+
+    (void) fflush(stdout);
+    if (tcsetattr(STDIN_FILENO, TCSADRAIN, &raw) < 0) {
         return -1;
     }
 
-    token = strtok_r(command_copy, delimiter, &last);
+    result = edit_line(line, size);
 
-    while (token != NULL) {
-        token_count++;
-        token = strtok_r(NULL, delimiter, &last);
-    }
+    (void) tcsetattr(STDIN_FILENO, TCSADRAIN, &saved);
 
-    (void) free(command_copy);
-    return token_count;
+    return result;
 }
 
 /**
- * Changes the directory based on the input. This will return the status based on
- * success of failure which can be used for '$' inputs in echo command. If null is
- * passed then the home directory is fetched of the user and then chdir into the 
- * home directory.
+ * edit_line reads keys from the terminal until return is pressed.
+ * It supports moving the cursor (left, right, ^A, ^E, ^B, ^F),
+ * deleting (backspace, ^D, ^K, ^U), walking the history (up, down,
+ * ^P, ^N) and incremental search through it (^R).
  **/
 int
-perform_directory_change(char *directory) {
-    uid_t current_user;
-    struct passwd *user_info;
+edit_line(char **line, size_t *size) {
+    struct line_editor editor;
+    char key, sequence[3];
+    char *draft;
+    size_t draft_length;
+
+    editor.line = line;
+    editor.size = size;
+    editor.length = 0;
+    editor.cursor = 0;
+    (void) sprintf(editor.prompt, "%.*s$ ", (int) sizeof(editor.prompt) - 3, getprogname());
+    editor.history_index = shell_history.count;
+    draft = NULL;
+    draft_length = 0;
+
+    if (ensure_line_capacity(&editor, 1) != 0) {
+        return -1;
+    }
+    (void) refresh_line(&editor, NULL);
 
-    if (directory == NULL) {
-        current_user = geteuid();
-        if ((user_info = getpwuid(current_user)) == NULL) {
-            print_error("Could not determine home directory", 1);
-            return 127;
+    for (;;) {
+        if (read_key(&key) != 0) {
+            (void) free(draft);
+            return -1;
         }
 
-        if ((directory = strdup(user_info->pw_dir)) == NULL) {
-            print_error("Could not allocate memory", 1);
-            return 127;
+        if (key == '\r' || key == '\n') {
+            break;
+        } else if (key == KEY_CTRL('C')) {
+            (void) write_exact(STDOUT_FILENO, "^C", 2);
+            editor.length = 0;
+            break;
+        } else if (key == KEY_CTRL('D') && editor.length == 0) {
+            (void) write_exact(STDOUT_FILENO, "\r\n", 2);
+            (void) free(draft);
+            return -1;
+        } else if (key == KEY_CTRL('R')) {
+            if (reverse_search(&editor) == 1) {
+                break;
+            }
+            continue;
+        } else if (key == '\033') {
+            if (read_key(&sequence[0]) != 0 || read_key(&sequence[1]) != 0) {
+                continue;
+            }
+            if (sequence[0] != '[' && sequence[0] != 'O') {
+                continue;
+            }
+            switch (sequence[1]) {
+            case 'A': key = KEY_CTRL('P'); break;
+            case 'B': key = KEY_CTRL('N'); break;
+            case 'C': key = KEY_CTRL('F'); break;
+            case 'D': key = KEY_CTRL('B'); break;
+            case 'H': key = KEY_CTRL('A'); break;
+            case 'F': key = KEY_CTRL('E'); break;
+            case '3':
+                if (read_key(&sequence[2]) != 0 || sequence[2] != '~') {
+                    continue;
+                }
+                key = KEY_CTRL('D');
+                break;
+            default:
+                continue;
+            }
+        }
+
+        if (key == KEY_CTRL('P') || key == KEY_CTRL('N')) {
+            if (!shell_history.loaded) {
+                if (load_history() != 0) {
+                    continue;
+                }
+                /* Only now are the entries there to be counted */
+                editor.history_index = shell_history.count;
+            }
+
+            if (key == KEY_CTRL('P') && editor.history_index > 0) {
+                if (editor.history_index == shell_history.count) {
+                    (void) free(draft);
+                    if ((draft = malloc(editor.length + 1)) != NULL) {
+                        (void) memcpy(draft, *line, editor.length);
+                        draft_length = editor.length;
+                    }
+                }
+                editor.history_index--;
+            } else if (key == KEY_CTRL('N') && editor.history_index < shell_history.count) {
+                editor.history_index++;
+            } else {
+                continue;
+            }
+
+            if (editor.history_index == shell_history.count) {
+                (void) set_line(&editor, draft, draft != NULL ? draft_length : 0);
+            } else {
+                (void) set_line(&editor, shell_history.entries[editor.history_index].line,
+                                shell_history.entries[editor.history_index].length);
+            }
+        } else if (key == KEY_CTRL('A')) {
+            editor.cursor = 0;
+        } else if (key == KEY_CTRL('E')) {
+            editor.cursor = editor.length;
+        } else if (key == KEY_CTRL('B')) {
+            editor.cursor -= editor.cursor > 0;
+        } else if (key == KEY_CTRL('F')) {
+            editor.cursor += editor.cursor < editor.length;
+        } else if ((key == 127 || key == KEY_CTRL('H')) && editor.cursor > 0) {
+            (void) memmove(*line + editor.cursor - 1, *line + editor.cursor,
+                           editor.length - editor.cursor);
+            editor.cursor--;
+            editor.length--;
+        } else if (key == KEY_CTRL('D') && editor.cursor < editor.length) {
+            (void) memmove(*line + editor.cursor, *line + editor.cursor + 1,
+                           editor.length - editor.cursor - 1);
+            editor.length--;
+        } else if (key == KEY_CTRL('K')) {
+            editor.length = editor.cursor;
+        } else if (key == KEY_CTRL('U')) {
+            (void) memmove(*line, *line + editor.cursor, editor.length - editor.cursor);
+            editor.length -= editor.cursor;
+            editor.cursor = 0;
+        } else if ((unsigned char) key >= ' ' && key != 127) {
+            if (ensure_line_capacity(&editor, editor.length + 2) != 0) {
+                continue;
+            }
+            (void) memmove(*line + editor.cursor + 1, *line + editor.cursor,
+                           editor.length - editor.cursor);
+            (*line)[editor.cursor++] = key;
+            editor.length++;
+        } else {
+            continue;
         }
+
+        (void) refresh_line(&editor, NULL);
     }
 
-    if (chdir(directory) < 0) {
-        print_error("cd: Could not change directory", 0);
-        return errno;
-    }    
+    (void) free(draft);
+    (*line)[editor.length] = '\0';
+    (void) write_exact(STDOUT_FILENO, "\r\n", 2);
 
     return 0;
 }
 
 /**
- * replace_dollars_in_tokens will iterate over the tokens and
- * check if the tokens contain $$ or $? to and if they do, they 
- * will be replaced by pid and previous return code respectively
+ * reverse_search runs the ^R incremental search. Typed characters
+ * narrow the search, ^R moves on to older matches and ^G or ^C give
+ * up. Return takes the match and returns 1 so it is run right away;
+ * any other key takes it into the line for editing and returns 0.
  **/
 int
-replace_dollars_in_tokens(char **tokens, int token_count) {
-    int index, j_index, is_prevous_dollar, token_length, pid_length;
-    int new_token_length, prev_exit_code_len, modified;
-    pid_t pid;
-    char *temp_token, *pid_string, *exit_code_str;
+reverse_search(struct line_editor *editor) {
+    char query[EDIT_QUERY_SIZE], key, *original;
+    size_t query_length, original_length;
+    int match, found;
 
-    pid = getpid();
-    is_prevous_dollar = 0;
-    pid_length = get_number_of_digits(pid) + 1;
-    prev_exit_code_len = get_number_of_digits(previous_exit_code) + 1;
-    new_token_length = -1;
+    query_length = 0;
 
-    if ((pid_string = malloc(pid_length + 1)) == NULL) {
-        print_error("Could not allocate memory", 1);
-        return 127;        
+    if (!shell_history.loaded) {
+        if (load_history() != 0) {
+            return 0;
+        }
+        editor->history_index = shell_history.count;
     }
 
-    if ((exit_code_str = malloc(prev_exit_code_len + 1)) == NULL) {
-        print_error("Could not allocate memory", 1);
-        return 127;        
-    }
+    match = shell_history.count;
 
-    if (snprintf(pid_string, pid_length, "%i", pid) < 0) {
-        print_error("echo: ", 0);
-        return 127;
+    if ((original = malloc(editor->length + 1)) == NULL) {
+        return 0;
     }
 
-    if (snprintf(exit_code_str, prev_exit_code_len, "%i", previous_exit_code) < 0) {
-        print_error("echo: ", 0);
-        return 127;
-    }
+    (void) memcpy(original, *editor->line, editor->length);
+    original_length = editor->length;
 
-    for (index = 0; index < token_count; index++) {
-        token_length = strlen(tokens[index]);
-        new_token_length = token_length;
-        modified = 0;
-        
-        for (j_index = 0; j_index < token_length; j_index++) {
-            if (tokens[index][j_index] == '$') {
-                if (is_prevous_dollar) {
-                    new_token_length = new_token_length + pid_length - 2;
-                    is_prevous_dollar = 0;
-                    modified = 1;
-                } else {
-                    is_prevous_dollar = 1;
-                }
-            } else if (tokens[index][j_index] == '?') {
-                if (is_prevous_dollar) {
-                    new_token_length = new_token_length + prev_exit_code_len - 2;
-                    is_prevous_dollar = 0;
-                    modified = 1;
-                }
-            } else {
-                new_token_length++;
-                is_prevous_dollar = 0;
+    (void) refresh_line(editor, "");
+
+    for (;;) {
+        if (read_key(&key) != 0) {
+            (void) free(original);
+            return 0;
+        }
+
+        if (key == KEY_CTRL('G') || key == KEY_CTRL('C')) {
+            (void) set_line(editor, original, original_length);
+            (void) refresh_line(editor, NULL);
+            (void) free(original);
+            return 0;
+        } else if (key == KEY_CTRL('R')) {
+            if (query_length > 0 &&
+                (found = search_history(query, query_length, match)) >= 0) {
+                match = found;
             }
+        } else if (key == 127 || key == KEY_CTRL('H')) {
+            query_length -= query_length > 0;
+            match = query_length > 0 ?
+                    search_history(query, query_length, shell_history.count) : -1;
+        } else if ((unsigned char) key >= ' ' && query_length + 1 < sizeof(query)) {
+            query[query_length++] = key;
+            /* The current match may still contain the longer query */
+            match = search_history(query, query_length,
+                                   match >= 0 && match < shell_history.count ?
+                                   match + 1 : shell_history.count);
+        } else {
+            break;
         }
 
-        if (is_prevous_dollar) {
-            new_token_length++;
+        if (match >= 0 && match < shell_history.count) {
+            (void) set_line(editor, shell_history.entries[match].line,
+                            shell_history.entries[match].length);
+            editor->history_index = match;
         }
 
-        if (!modified) {
-            continue;
-        } else {
-            if ((temp_token = malloc(new_token_length + 1)) == NULL) {
-                print_error("Could not allocate memory", 1);
-                return 127;
-            }
+        query[query_length] = '\0';
+        (void) refresh_line(editor, query);
+    }
 
-            temp_token[0] = '\0';
-            is_prevous_dollar = 0;
+    (void) refresh_line(editor, NULL);
+    (void) free(original);
 
-            for (j_index = 0; j_index < token_length; j_index++) {
-                if (tokens[index][j_index] == '$') {
-                    if (is_prevous_dollar) {
-                        if (strcat(temp_token, pid_string) == NULL) {
-                            print_error("Internal error: ", 1);
-                            return 127;
-                        }
-                        is_prevous_dollar = 0;
-                    } else {
-                        is_prevous_dollar = 1;
-                    }
-                } else if (tokens[index][j_index] == '?') {
-                    if (is_prevous_dollar) {
-                        if (strcat(temp_token, exit_code_str) == NULL) {
-                            print_error("Internal error: ", 1);
-                            return 127;
-                        }
-                        modified = 1;
-                        is_prevous_dollar = 0;
-                    } else {
-                        if (append_char(temp_token, '?') != 0) {
-                            print_error("Internal error: ", 1);
-                            return 127;
-                        }
-                    }
-                } else {
-                    if (is_prevous_dollar) {
-                        if (append_char(temp_token, '$') != 0) {
-                            print_error("Internal error: ", 1);
-                            return 127;
-                        }
-                    }
+    return key == '\r' || key == '\n';
+}
 
-                    if (append_char(temp_token, tokens[index][j_index]) != 0) {
-                        print_error("Internal error: ", 1);
-                        return 127;
-                    }
-                    is_prevous_dollar = 0;
-                }
-            }
+/**
+ * refresh_line redraws the prompt and the line being edited and puts
+ * the terminal cursor where the editing cursor is. With a search query
+ * the reverse search prompt is shown instead.
+ **/
+void
+refresh_line(struct line_editor *editor, char *query) {
+    char *output, position[32];
+    int length, capacity, column;
 
-            if (is_prevous_dollar) {
-                 if (append_char(temp_token, '$') != 0) {
-                    print_error("Internal error: ", 1);
-                    return 127;
-                }
-            }
+    output = NULL;
+    length = 0;
+    capacity = 0;
 
-            tokens[index] = '\0';
-            
-            if ((tokens[index] = strdup(temp_token)) == NULL) {
-                print_error("Could not allocate memory", 1);
-                return 127;
-            }
+    if (append_to_buffer(&output, &length, &capacity, "\r", 1) != 0) {
+        return;
+    }
 
-            (void) free(temp_token);
-        }
+    if (query != NULL) {
+        (void) append_to_buffer(&output, &length, &capacity, "(reverse-i-search)`", 19);
+        (void) append_to_buffer(&output, &length, &capacity, query, strlen(query));
+        (void) append_to_buffer(&output, &length, &capacity, "': ", 3);
+        column = length - 1;
+    } else {
+        (void) append_to_buffer(&output, &length, &capacity, editor->prompt,
+                                strlen(editor->prompt));
+        column = length - 1 + editor->cursor;
     }
 
-    (void) free(pid_string);
-    (void) free(exit_code_str);
+    (void) append_to_buffer(&output, &length, &capacity, *editor->line, editor->length);
+    (void) append_to_buffer(&output, &length, &capacity, "\033[K\r", 4);
 
-    return 0;
+    if (column > 0) {
+        (void) sprintf(position, "\033[%dC", column);
+        (void) append_to_buffer(&output, &length, &capacity, position, strlen(position));
+    }
+
+    if (output != NULL) {
+        (void) write_exact(STDOUT_FILENO, output, length);
+        (void) free(output);
+    }
 }
 
+/**
+ * set_line replaces the line being edited with text and moves the
+ * cursor to its end.
+ **/
+int
+set_line(struct line_editor *editor, char *text, size_t length) {
+    if (ensure_line_capacity(editor, length + 1) != 0) {
+        return 1;
+    }
+
+    if (length > 0) {
+        (void) memcpy(*editor->line, text, length);
+    }
+    editor->length = length;
+    editor->cursor = length;
+
+    return 0;
+}
 
 /**
- * echo like feature is performed on the tokens [1..n-1]
+ * ensure_line_capacity grows the line buffer to hold at least needed
+ * bytes.
  **/
 int
-perform_echo(char **tokens, int token_count, int command_length) {
-    char *echo_string;
-    int index, total_output_length;
+ensure_line_capacity(struct line_editor *editor, size_t needed) {
+    char *grown;
 
-    total_output_length = command_length;
+    if (*editor->line != NULL && *editor->size >= needed) {
+        return 0;
+    }
 
-    if ((echo_string = malloc(total_output_length + 1)) == NULL) {
-        print_error("cd: Could not allocate memory", 0);
-        return 127;
+    if ((grown = realloc(*editor->line, needed * 2)) == NULL) {
+        print_error("Could not allocate memory", 1);
+        return 1;
     }
 
-    echo_string[0] = '\0';
+    *editor->line = grown;
+    *editor->size = needed * 2;
 
-    for (index = 1; index < token_count; index++) {
-        if (index > 0) {
-            if (strcat(echo_string, " ") == NULL) {
-                print_error("cd: Internal error: ", 0);
-            }
-        }
+    return 0;
+}
 
-        if (strcat(echo_string, tokens[index]) == NULL) {
-            print_error("cd: Internal error: ", 0);
-        }
+/**
+ * read_key reads a single key from the terminal, retrying when
+ * interrupted. Returns 1 at end of input.
+ **/
+int
+read_key(char *key) {
+    ssize_t bytes;
+
+    while ((bytes = read(STDIN_FILENO, key, 1)) < 0 && errno == EINTR) {
+        continue;
     }
 
-    fprintf(stdout, "%s\n", echo_string);
+    return bytes != 1;
+}
 
-    (void) free(echo_string);
+/**
+ * parse_duration reads a number of seconds with an optional s, m, h
+ * or d suffix. Returns -1 if the duration is not valid or too long.
+ **/
+double
+parse_duration(char *duration) {
+    double value;
+    char *end;
 
-    return 0;   
+    value = strtod(duration, &end);
+
+    if (end == duration || value < 0) {
+        return -1;
+    }
+
+    switch (*end) {
+    case '\0':
+    case 's':
+        break;
+    case 'm':
+        value *= 60;
+        break;
+    case 'h':
+        value *= 60 * 60;
+        break;
+    case 'd':
+        value *= 24 * 60 * 60;
+        break;
+    default:
+        return -1;
+    }
+
+    if (*end != '\0' && end[1] != '\0') {
+        return -1;
+    }
+
+    /* Also rejects inf and nan, which strtod accepts */
+    if (!(value <= MAX_DURATION_SECONDS)) {
+        return -1;
+    }
+
+    return value;
 }
 
 /**
- * perform_exec executes the command which should be at the 0
- * position of the tokens array. It passes tokens as the args as 
- * it is.
+ * parse_signal accepts a signal number or one of the common signal
+ * names, with or without the SIG prefix. Returns -1 when the signal
+ * is not recognised.
  **/
 int
-perform_exec(char **tokens) {
-    int status;
-    pid_t child_pid;
-  
-    if ((child_pid = fork()) < 0) {
-        print_error("Could not create new process: ", 1);
-        return 127;
-    } else if (child_pid == 0) {
-        execvp(tokens[0], tokens);
-        
-        if (errno == ENOENT) {
-            fprintf(stderr, "%s: command not found\n", tokens[0]);
-        } else {
-            fprintf(stderr, "%s: %s\n", tokens[0], strerror(errno));
-        }
-
-        exit(127);
+parse_signal(char *name) {
+    static const struct {
+        const char *name;
+        int         number;
+    } signals[] = {
+        { "HUP",  SIGHUP  }, { "INT",  SIGINT  }, { "QUIT", SIGQUIT },
+        { "KILL", SIGKILL }, { "USR1", SIGUSR1 }, { "USR2", SIGUSR2 },
+        { "ALRM", SIGALRM }, { "TERM", SIGTERM }, { "CONT", SIGCONT },
+        { "STOP", SIGSTOP }
+    };
+    char *end;
+    long number;
+    unsigned int index;
+
+    number = strtol(name, &end, 10);
+
+    if (end != name && *end == '\0') {
+        return (number > 0 && number < NSIG) ? (int) number : -1;
     }
 
-    (void) waitpid(child_pid, &status, 0);
+    if (strncmp(name, "SIG", 3) == 0) {
+        name += 3;
+    }
 
-    if (WIFEXITED(status)) {
-        status = WEXITSTATUS(status);
+    for (index = 0; index < sizeof(signals) / sizeof(signals[0]); index++) {
+        if (strcmp(name, signals[index].name) == 0) {
+            return signals[index].number;
+        }
     }
 
-    return status;
+    return -1;
 }
 
 void
@@ -834,7 +6072,7 @@ get_number_of_digits(int number) {
  **/
 int
 redirect_file_descriptors(char **tokens, int token_count) {
-    int input_file_descriptor, output_file_descriptor, index, mode;
+    int input_file_descriptor, output_file_descriptor, index, mode, descriptor;
     char *file_name, **tokens_copy;
     int count, offset;
 
@@ -844,13 +6082,13 @@ redirect_file_descriptors(char **tokens, int token_count) {
     count = token_count;
     offset = 0;
 
-    if ((tokens_copy = malloc(token_count * sizeof(char *))) == NULL) {
+    if ((tokens_copy = shell_malloc(token_count * sizeof(char *))) == NULL) {
         print_error("Could not allocate memory", 1);
         return 127;
     }
 
     for (index = 0; index < token_count; index++) {
-        if ((tokens_copy[index] = strdup(tokens[index])) == NULL) {
+        if ((tokens_copy[index] = shell_strdup(tokens[index])) == NULL) {
             print_error("Could not allocate memory", 1);
             return 127;
         }
@@ -870,19 +6108,19 @@ redirect_file_descriptors(char **tokens, int token_count) {
         }
 
         if (strcmp(tokens_copy[index], ">") == 0) {
-            if ((file_name = strdup(tokens_copy[index + 1])) == NULL) {
+            if ((file_name = shell_strdup(tokens_copy[index + 1])) == NULL) {
                 print_error("Could not allocate memory", 1);
                 return 127;
             }
             mode = 1;
         } else if (strcmp(tokens_copy[index], ">>") == 0) {
-            if ((file_name = strdup(tokens_copy[index + 1])) == NULL) {
+            if ((file_name = shell_strdup(tokens_copy[index + 1])) == NULL) {
                 print_error("Could not allocate memory", 1);
                 return 127;
             }
             mode = 2;
         } else if (strcmp(tokens_copy[index], "<") == 0) {
-             if ((file_name = strdup(tokens_copy[index + 1])) == NULL) {
+             if ((file_name = shell_strdup(tokens_copy[index + 1])) == NULL) {
                 print_error("Could not allocate memory", 1);
                 return 127;
             }
@@ -901,24 +6139,38 @@ redirect_file_descriptors(char **tokens, int token_count) {
             return 127;
         }
 
+        /* >&N and <&N redirect to a copy of descriptor N */
+        if (file_name[0] == '&' && (mode == 1 || mode == 3)) {
+            if ((descriptor = duplicate_redirection_target(file_name + 1)) < 0) {
+                return 127;
+            }
+
+            if (mode == 1) {
+                output_file_descriptor = descriptor;
+            } else {
+                input_file_descriptor = descriptor;
+            }
+            continue;
+        }
+
         switch (mode) {
             case 1:
                 if ((output_file_descriptor = 
-                        open(file_name, O_CREAT | O_WRONLY | O_TRUNC, 0644)) < 0) {
+                        open(file_name, O_CREAT | O_WRONLY | O_TRUNC | O_CLOEXEC, 0644)) < 0) {
                     print_error("Could not open file for writing", 1);
                     return 127;
                 }
                 break;
             case 2:
                  if ((output_file_descriptor = 
-                        open(file_name, O_CREAT | O_WRONLY | O_APPEND, 0644)) < 0) {
+                        open(file_name, O_CREAT | O_WRONLY | O_APPEND | O_CLOEXEC, 0644)) < 0) {
                     print_error("Could not open file for writing", 1);
                     return 127;
                 }
                 break;
             case 3:
                 if ((input_file_descriptor = 
-                        open(file_name, O_RDONLY, 0644)) < 0) {
+                        open(file_name, O_RDONLY | O_CLOEXEC, 0644)) < 0) {
                     print_error("Could not open file for writing", 1);
                     return 127;
                 }
@@ -928,6 +6180,8 @@ redirect_file_descriptors(char **tokens, int token_count) {
         }
     }
 
+    (void) fflush(stdout);
+
     if (input_file_descriptor != STDIN_FILENO) {
         if (dup2(input_file_descriptor, STDIN_FILENO) != STDIN_FILENO) {
             print_error("Could duplicate file descriptor", 1);
@@ -949,6 +6203,32 @@ redirect_file_descriptors(char **tokens, int token_count) {
     return 0;
 }
 
+/**
+ * duplicate_redirection_target duplicates the descriptor numbered by
+ * target for a >&N or <&N redirection. Returns -1 on errors.
+ **/
+int
+duplicate_redirection_target(char *target) {
+    char *end;
+    long fd;
+    int descriptor;
+
+    fd = strtol(target, &end, 10);
+
+    if (end == target || *end != '\0' || fd < 0 || fd > INT_MAX) {
+        errno = 0;
+        print_error("Syntax error: bad descriptor in redirection", 1);
+        return -1;
+    }
+
+    if ((descriptor = fcntl((int) fd, F_DUPFD_CLOEXEC, 0)) < 0) {
+        print_error("Could not duplicate file descriptor", 1);
+        return -1;
+    }
+
+    return descriptor;
+}
+
 /**
  * create_string_from_index takes a string and an index.
  * It will use the index as the start point and end as the length of the
@@ -983,7 +6263,7 @@ create_string_from_index(char *input, int index) {
 int
 append_char(char *string, char character) {
     char *temp;
-    if ((temp = malloc(2)) == NULL) {
+    if ((temp = shell_malloc(2)) == NULL) {
          return 1;
     }
                 
@@ -1006,6 +6286,10 @@ append_char(char *string, char character) {
  **/
 void
 reset_file_descriptors() {
+    /* Builtins write through stdio, so their output has to reach the
+       redirected descriptor before it is swapped back */
+    (void) fflush(stdout);
+
     (void) close(STDOUT_FILENO);
     (void) close(STDIN_FILENO);
 
@@ -1020,6 +6304,92 @@ reset_file_descriptors() {
     }
 }
 
+/**
+ * adopt_standard_descriptors makes the current stdin/stdout the
+ * descriptors restored after each command. Children that were handed
+ * a pipe or socket as stdin/stdout call this so that builtins and
+ * redirections inside them do not fall back to the shell's terminal.
+ **/
+void
+adopt_standard_descriptors() {
+    (void) close(default_standard_input);
+    (void) close(default_standard_output);
+
+    if ((default_standard_input = duplicate_shell_descriptor(STDIN_FILENO)) < 0 ||
+        (default_standard_output = duplicate_shell_descriptor(STDOUT_FILENO)) < 0) {
+        print_error("Could not duplicate file descriptor", 1);
+        exit(127);
+    }
+}
+
+/**
+ * duplicate_shell_descriptor duplicates fd above the descriptors
+ * commands may use and marks it close-on-exec, so the shell's own
+ * copies never leak into the programs it runs.
+ **/
+int
+duplicate_shell_descriptor(int fd) {
+    return fcntl(fd, F_DUPFD_CLOEXEC, SHELL_FD_BASE);
+}
+
+/**
+ * close_stray_descriptors runs right before exec and closes every
+ * descriptor from SHELL_FD_BASE up, including ones the shell itself
+ * inherited, except the process substitution ends the command was
+ * given as /dev/fd/N. Descriptors below SHELL_FD_BASE belong to the
+ * user and are left alone. The copies of stdin and stdout, including
+ * those saved by enclosing brace groups, are kept too: they are
+ * close-on-exec anyway, and if the exec fails the shell still restores
+ * its descriptors from them.
+ **/
+void
+close_stray_descriptors() {
+    struct saved_descriptors *saved;
+    int fd, highest, index, keep;
+
+    highest = SHELL_FD_BASE - 1;
+    for (index = 0; index < process_substitution_count; index++) {
+        if (process_substitutions[index].fd > highest) {
+            highest = process_substitutions[index].fd;
+        }
+    }
+
+    if (default_standard_input > highest) {
+        highest = default_standard_input;
+    }
+    if (default_standard_output > highest) {
+        highest = default_standard_output;
+    }
+    for (saved = saved_descriptors; saved != NULL; saved = saved->outer) {
+        if (saved->input > highest) {
+            highest = saved->input;
+        }
+        if (saved->output > highest) {
+            highest = saved->output;
+        }
+    }
+
+    for (fd = SHELL_FD_BASE; fd <= highest; fd++) {
+        keep = fd == default_standard_input || fd == default_standard_output;
+        for (index = 0; index < process_substitution_count; index++) {
+            if (process_substitutions[index].fd == fd) {
+                keep = 1;
+            }
+        }
+        for (saved = saved_descriptors; saved != NULL; saved = saved->outer) {
+            if (saved->input == fd || saved->output == fd) {
+                keep = 1;
+            }
+        }
+
+        if (!keep) {
+            (void) close(fd);
+        }
+    }
+
+    (void) closefrom(highest + 1);
+}
+
 void
 remove_element(char **tokens, int position, int token_count) {
     int index;
@@ -1038,7 +6408,7 @@ reiterate_token_count(char **tokens) {
     int index;
     index = 0;
     
-    while(tokens[index] != '\0') {
+    while(tokens[index] != NULL) {
         index++;
     }
 
@@ -1,6 +1,228 @@
+#define SERVER_FD_COUNT 4
+
+/* Lowest descriptor used for the shell's own copies */
+#define SHELL_FD_BASE 10
+
+#define LIST_END        0
+#define LIST_SEQUENTIAL 1
+#define LIST_AND        2
+#define LIST_OR         3
+#define LIST_BACKGROUND 4
+
+/* Longest timeout accepted, so it always fits a time_t */
+#define MAX_DURATION_SECONDS 2147483647.0
+
+#define RELAY_BUFFER_SIZE 65536
+
+/* Room left for the exec'd program's auxiliary vector and the like */
+#define ARG_HEADROOM 2048
+
+#define BATCH_READ_SIZE 65536
+
+#define HISTORY_FILE     ".sish_history"
+#define EDIT_PROMPT_SIZE 64
+#define EDIT_QUERY_SIZE  256
+#define KEY_CTRL(key)    ((key) & 0x1f)
+
+#define SOURCE_MAX_DEPTH 100
+
+/* The nanosecond timestamps of struct stat */
+#if defined(__linux__)
+#define STAT_MODIFIED(info) ((info).st_mtim)
+#define STAT_CHANGED(info)  ((info).st_ctim)
+#else
+#define STAT_MODIFIED(info) ((info).st_mtimespec)
+#define STAT_CHANGED(info)  ((info).st_ctimespec)
+#endif
+
+#define MAPFILE_READ_SIZE (1024 * 1024)
+#define MAPFILE_QUANTUM   5000
+
+#define MAX_LIMIT_SETTINGS 16
+#define LIMIT_FLAGS        "cdfmnstuv"
+
+/* Cpu numbers in a cpu list must be below this */
+#define MAX_CPUS 1024
+
+#define IO_CLASS_REALTIME    1
+#define IO_CLASS_BEST_EFFORT 2
+#define IO_CLASS_IDLE        3
+#define IOPRIO_WHO_PROCESS   1
+#define IOPRIO_CLASS_SHIFT   13
+
 struct flags {
-    int c_flag;
-    int x_flag;
+    int   c_flag;
+    int   x_flag;
+    int   pipefail;
+    int   pipe_stats;
+    int   arg_batch;
+    char *server_path;
+    char *client_path;
+    char *record_path;
+    char *replay_path;
+};
+
+struct server_request {
+    size_t command_length;
+    int    x_flag;
+};
+
+struct server_worker {
+    pid_t pid;
+    int   connection;
+};
+
+struct process_substitution {
+    pid_t pid;
+    int   fd;
+};
+
+struct schedule {
+    int *cpus;
+    int  cpu_count;
+    int  set_nice;
+    int  nice;
+    int  io_class;
+    int  io_level;
+};
+
+struct limit_option {
+    char        flag;
+    int         resource;
+    int         unit;
+    const char *description;
+    const char *unit_name;
+};
+
+struct limit_setting {
+    struct limit_option *option;
+    rlim_t               value;
+};
+
+struct resource_limits {
+    struct limit_setting settings[MAX_LIMIT_SETTINGS];
+    int                  count;
+    int                  hard;
+    int                  soft;
+};
+
+struct batch_limits {
+    int    jobs;
+    int    max_args;
+    size_t max_bytes;
+};
+
+struct parallel_job {
+    pid_t  pid;
+    int    status;
+    int    done;
+    int    output_fd;
+    int    error_fd;
+    char  *output;
+    int    output_length;
+    int    output_capacity;
+    char  *error;
+    int    error_length;
+    int    error_capacity;
+};
+
+struct history_entry {
+    char   *line;
+    size_t  length;
+};
+
+struct history {
+    char                 *path;
+    int                   fd;
+    int                   loaded;
+    char                 *map;
+    size_t                map_length;
+    struct history_entry *entries;
+    int                   count;
+    int                   capacity;
+    int                  *sorted;
+};
+
+struct line_editor {
+    char   **line;
+    size_t  *size;
+    size_t   length;
+    size_t   cursor;
+    int      history_index;
+    char     prompt[EDIT_PROMPT_SIZE];
+};
+
+struct list_item {
+    char *text;
+    int   separator;
+};
+
+struct script_cache_entry {
+    dev_t             device;
+    ino_t             inode;
+    struct timespec   modified;
+    struct timespec   changed;
+    off_t             size;
+    struct list_item *items;
+    int               count;
+    int               users;
+};
+
+struct coprocess {
+    char  *name;
+    pid_t  pid;
+    int    input_fd;
+    int    output_fd;
+};
+
+struct mapfile_options {
+    int   count;
+    int   strip;
+    int   quantum;
+    char *callback;
+};
+
+struct statistics {
+    unsigned long commands;
+    unsigned long builtins;
+    unsigned long forks;
+    unsigned long execs;
+    unsigned long allocations;
+    unsigned long bytes_allocated;
+    double        lex_seconds;
+    double        expand_seconds;
+    double        redirect_seconds;
+    double        wait_seconds;
+};
+
+struct variable {
+    char  *name;
+    char **values;
+    int    count;
+};
+
+struct pipeline_stage {
+    pid_t          pid;
+    int            status;
+    int            input_fd;
+    int            output_fd;
+    int            poll_index;
+    char          *command;
+    char           buffer[RELAY_BUFFER_SIZE];
+    size_t         buffered;
+    size_t         offset;
+    unsigned long  bytes;
+    double         wall_seconds;
+    double         empty_seconds;
+    double         full_seconds;
+    struct rusage  usage;
+};
+
+/* The standard descriptor copies an enclosing brace group restores */
+struct saved_descriptors {
+    int                       input;
+    int                       output;
+    struct saved_descriptors *outer;
 };
 
 struct result {
@@ -10,31 +232,196 @@ struct result {
 };
 
 int previous_exit_code = 0;
+int execute_in_place = 0;
 int default_standard_output;
 int default_standard_input;
+struct saved_descriptors *saved_descriptors = NULL;
+
+/* The group after a prefix builtin, as in timeout 5 ( a | b ) */
+char *prefixed_group = NULL;
 
 struct flags input_flags;
 
+struct process_substitution *process_substitutions = NULL;
+int process_substitution_count = 0;
+
+struct statistics shell_statistics;
+struct history shell_history;
+FILE *record_file = NULL;
+
+struct script_cache_entry *script_cache = NULL;
+int script_cache_count = 0;
+int source_depth = 0;
+
+struct coprocess *coprocesses = NULL;
+int coprocess_count = 0;
+pid_t statistics_pid = -1;
+
+int *pipeline_cpus = NULL;
+int pipeline_cpu_count = 0;
+
+struct variable *variables = NULL;
+int variable_count = 0;
+
 void print_usage();
 void strip_new_line(char *input);
 void execute_command(char *command);
+int run_simple_command(char **tokens, int token_count);
 void print_error(char *message, int include_prog_name);
 void handle_sig_int(int signal);
+void handle_sig_child(int signal);
 void reset_file_descriptors();
+void adopt_standard_descriptors();
+void close_stray_descriptors();
+int duplicate_shell_descriptor(int fd);
+void finish_process_substitutions(int first);
 void remove_element(char **tokens, int position, int token_count);
 void pipleline_input_commands(char *input_command);
-void execute_backgroud_process(char *input_command);
+void execute_backgroud_process(char *command);
+void execute_input_line(char *input_command);
+void execute_list(char *list);
+void execute_pipeline(char *command);
+void execute_compound_command(char *command);
+int find_prefixed_group(char *command);
+void execute_prefixed_group(char *command, int group);
+void run_prefixed_group();
+void execute_subshell(char *list, char *redirections);
+void execute_brace_group(char *list, char *redirections);
+void finish_pipeline(int *statuses, int count);
+void pipeline_with_statistics(char **commands, int command_count);
+void print_pipeline_statistics(struct pipeline_stage *stages, int count);
+void print_shell_statistics(FILE *output);
+void dump_shell_statistics();
+void * shell_malloc(size_t size);
+void * shell_realloc(void *pointer, size_t size);
+void serve_request(int *request_fds, char *command, int x_flag);
 
 int get_char_count(char *command, char *delimiter);
+int next_list_item(char *list, int *position, char **item, int *separator);
+int update_group_depth(char *line, int index, int depth);
+int find_top_level(char *line, char character);
+int find_group_end(char *line, int start);
+int is_blank_string(char *string);
+int apply_group_redirections(char *redirections);
 int perform_directory_change(char *directory);
 int perform_echo(char **tokens, int token_count, int command_length);
 int perform_exec(char **tokens);
+int exec_command(char **tokens);
+int perform_batch(char **tokens, int token_count);
+int batch_oversized_command(char **tokens);
+int run_batches(char **prefix, int prefix_count, char **operands, int operand_count,
+                struct batch_limits *limits);
+int read_batch_operands(char **buffer, char ***operands, int *count);
+int parse_positive_number(char *number);
+int split_list(char *list, struct list_item **items, int *count);
+void execute_list_items(struct list_item *items, int count);
+void free_list_items(struct list_item *items, int count);
+int perform_source(char **tokens, int token_count);
+int load_script(char *name, char *path);
+int is_script_current(struct script_cache_entry *entry, struct stat *file_info);
+char * read_script(int fd, off_t size);
+void strip_comments(char *script);
+int perform_coproc(char **tokens, int token_count);
+int reap_coprocess(pid_t pid);
+int perform_read(char **tokens, int token_count);
+int perform_mapfile(char **tokens, int token_count);
+int read_stream(int fd, int line_limit, char **buffer, size_t *length);
+int split_lines(char *data, size_t length, struct mapfile_options *options,
+                char ***lines, int *count, size_t *consumed);
+int run_mapfile_callback(char *callback, int index, char *line);
+int is_variable_name(char *name);
+int duplicate_redirection_target(char *target);
+int open_record(char *path);
+int replay_session(char *path);
+int parse_record(char *record, double *duration, int *status, char **line);
+void execute_timed_line(char *line, double *duration);
+void open_history();
+int load_history();
+int append_history_entry(char *line, size_t length);
+void add_history(char *line);
+int compare_history_lines(char *line, size_t length, struct history_entry *entry);
+int compare_history_indexes(const void *first, const void *second);
+int find_history_prefix(char *prefix, size_t length);
+int search_history(char *text, size_t length, int start);
+int expand_history(char *line, char **expanded);
+int perform_history(char **tokens, int token_count);
+int read_input_line(char **line, size_t *size);
+int edit_line(char **line, size_t *size);
+int reverse_search(struct line_editor *editor);
+void refresh_line(struct line_editor *editor, char *query);
+int set_line(struct line_editor *editor, char *text, size_t length);
+int ensure_line_capacity(struct line_editor *editor, size_t needed);
+int read_key(char *key);
+int perform_parallel(char **tokens, int token_count);
+int start_parallel_job(struct parallel_job *job, char **arguments, int argument_count);
+int collect_parallel_output(struct parallel_job *job, int error_stream);
+void flush_parallel_job(struct parallel_job *job);
+char ** build_parallel_arguments(char **tokens, int token_count, char *input, int *argument_count);
+void free_arguments(char **arguments);
+int perform_timeout(char **tokens, int token_count);
+int perform_set(char **tokens, int token_count);
+int perform_shstats(char **tokens, int token_count);
+int is_builtin(char *name);
+int perform_sched(char **tokens, int token_count);
+int apply_schedule(void *argument);
+int run_prefixed_command(char **tokens, int token_count, int (*setup)(void *), void *argument);
+int run_prefixed_words(char **tokens, int token_count);
+int perform_ulimit(char **tokens, int token_count);
+int is_limit_value(char *value);
+int print_limit(struct limit_option *option, int hard, int describe);
+int apply_limits(void *argument);
+int parse_cpu_list(char *list, int **cpus, int *count);
+int parse_io_priority(char *priority, struct schedule *schedule);
+int set_cpu_affinity(int *cpus, int count);
+int set_io_priority(int io_class, int io_level);
+void close_pipeline_relays(struct pipeline_stage *stages, int count);
+int relay_stage_output(struct pipeline_stage *stage);
+int expand_named_parameter(char *parameter, int parameter_length, char **buffer,
+                           int *length, int *capacity);
+int is_name_character(char character, int first);
+int append_to_buffer(char **buffer, int *length, int *capacity, char *text, int text_length);
+int set_variable(char *name, char **values, int count);
+int store_variable(char *name, char **values, int count);
+int set_status_variable(char *name, int *statuses, int count);
+int parse_signal(char *name);
 int append_char(char *string, char character);
 int redirect_file_descriptors(char **tokens, int token_count);
 int reiterate_token_count(char **tokens);
-int replace_dollars_in_tokens(char **tokens, int token_count);
+int replace_dollars_in_tokens(char ***tokens, int *token_count);
+int splice_array_elements(char ***tokens, int *token_count, int position, struct variable *array);
+int is_descriptor_duplication(char *word);
 int print_command(char **tokens, int token_count);
+int run_server(char *socket_path);
+int run_client(char *socket_path, char *command);
+int receive_server_request(int connection, int *request_fds, char **command, int *x_flag);
+void close_received_descriptors(struct msghdr *message);
+int create_unix_address(struct sockaddr_un *address, char *socket_path);
+int read_exact(int fd, void *buffer, size_t length);
+int write_exact(int fd, void *buffer, size_t length);
+int get_exit_code(int status);
+int start_process_substitution(char *inner_command, int read_output);
 
 unsigned int get_number_of_digits(int number);
 
-char * create_string_from_index(char *input, int index);
\ No newline at end of file
+size_t argument_size(char *argument);
+size_t argument_space();
+
+double parse_duration(char *duration);
+double monotonic_seconds();
+
+struct variable * find_variable(char *name);
+struct variable * find_array_word(char *token);
+
+int parse_limit_value(char *value, struct limit_option *option, rlim_t *limit);
+
+struct limit_option * find_limit_option(char flag);
+
+pid_t fork_child();
+pid_t wait_for_child(pid_t child, int *status);
+
+char * create_string_from_index(char *input, int index);
+char * expand_process_substitutions(char *command);
+char * expand_parameters(char *token);
+char * shell_strdup(char *string);
+char ** tokenize_command(char *command, int *token_count_out);
+char ** split_top_level(char *line, char separator, int *count);
\ No newline at end of file